@@ -10,6 +10,11 @@ Roomba::Roomba(HardwareSerial* serial, Baud baud)
   _serial = serial;
   _baud = baudCodeToBaudRate(baud);
   _pollState = PollStateIdle;
+  _queryState = QueryStateIdle;
+  _queryCallback = NULL;
+  _receiveCallback = NULL;
+  _streaming = false;
+  _lastByteTime = 0;
 }
 
 // Resets the
@@ -184,6 +189,7 @@ void Roomba::playSong(uint8_t songNumber)
 // Start a stream of sensor data with the specified packet IDs in it
 void Roomba::stream(const uint8_t* packetIDs, int len)
 {
+  _streaming = len > 0;
   _serial->write(148);
   _serial->write((uint8_t)len);
   _serial->write(packetIDs, len);
@@ -192,6 +198,7 @@ void Roomba::stream(const uint8_t* packetIDs, int len)
 // One of StreamCommand*
 void Roomba::streamCommand(StreamCommand command)
 {
+  _streaming = command == StreamCommandResume;
   _serial->write(150);
   _serial->write(command);
 }
@@ -263,10 +270,10 @@ bool Roomba::getData(uint8_t* dest, uint8_t len)
     while (!_serial->available())
     {
       // Look for a timeout
-      if (millis() > startTime + ROOMBA_READ_TIMEOUT)
+      if (millis() - startTime > ROOMBA_READ_TIMEOUT)
         return false; // Timed out
     }
-    *dest++ = _serial->read();
+    *dest++ = readByte();
   }
   return true;
 }
@@ -287,11 +294,18 @@ bool Roomba::getSensorsList(uint8_t* packetIDs, uint8_t numPacketIDs, uint8_t* d
 }
 
 // Simple state machine to read sensor data and discard everything else
+// Bytes arriving between stream packets belong to an outstanding asynchronous query, if any
 bool Roomba::pollSensors(uint8_t* dest, uint8_t destSize, uint8_t *packetLen)
 {
+    checkQueryTimeout();
     while (_serial->available())
     {
-	uint8_t ch = _serial->read();
+	uint8_t ch = readByte();
+	if (_queryState == QueryStatePending && _querySent && _pollState == PollStateIdle)
+	{
+	    queryByte(ch);
+	    continue;
+	}
 	switch (_pollState)
 	{
 	    case PollStateIdle:
@@ -321,6 +335,7 @@ bool Roomba::pollSensors(uint8_t* dest, uint8_t destSize, uint8_t *packetLen)
 		break;
 	}
     }
+    sendQueryWhenQuiet();
     return false;
 }
 
@@ -335,12 +350,12 @@ uint8_t Roomba::getScript(uint8_t* dest, uint8_t len)
   while (!_serial->available())
   {
     // Look for a timeout
-    if (millis() > startTime + ROOMBA_READ_TIMEOUT)
+    if (millis() - startTime > ROOMBA_READ_TIMEOUT)
       return 0; // Timed out
   }
 
-  int count = _serial->read();
-  if (count > 100 || count < 0)
+  int count = readByte();
+  if (count > 100)
     return 0; // Something wrong. Cant have such big scripts!!
 
   // Get all the data, saving as much as we can
@@ -351,13 +366,167 @@ uint8_t Roomba::getScript(uint8_t* dest, uint8_t len)
     while (!_serial->available())
     {
       // Look for a timeout
-      if (millis() > startTime + ROOMBA_READ_TIMEOUT)
+      if (millis() - startTime > ROOMBA_READ_TIMEOUT)
         return 0; // Timed out
     }
-    uint8_t data = _serial->read();
+    uint8_t data = readByte();
     if (i < len)
       *dest++ = data;
   }
 
   return count;
 }
+
+bool Roomba::getSensorsAsync(uint8_t packetID, uint8_t* dest, uint8_t len, QueryCallback callback)
+{
+  if (_queryState == QueryStatePending)
+    return false;
+  uint8_t command[] = {142, packetID};
+  beginQuery(command, sizeof(command), dest, len, false, callback);
+  return true;
+}
+
+bool Roomba::getSensorsListAsync(uint8_t* packetIDs, uint8_t numPacketIDs, uint8_t* dest, uint8_t len, QueryCallback callback)
+{
+  if (_queryState == QueryStatePending || numPacketIDs > ROOMBA_MAX_QUERY_IDS)
+    return false;
+  uint8_t command[ROOMBA_MAX_QUERY_IDS + 2] = {149, numPacketIDs};
+  memcpy(command + 2, packetIDs, numPacketIDs);
+  beginQuery(command, numPacketIDs + 2, dest, len, false, callback);
+  return true;
+}
+
+bool Roomba::getScriptAsync(uint8_t* dest, uint8_t len, QueryCallback callback)
+{
+  if (_queryState == QueryStatePending)
+    return false;
+  uint8_t command[] = {154};
+  beginQuery(command, sizeof(command), dest, len, true, callback);
+  return true;
+}
+
+// A response can't be told apart from stream data, so a running stream is
+// paused first and the query is only sent once the stream has gone quiet
+void Roomba::beginQuery(const uint8_t* command, uint8_t commandLen, uint8_t* dest, uint8_t len, bool script, QueryCallback callback)
+{
+  memcpy(_queryCommand, command, commandLen);
+  _queryCommandLen = commandLen;
+  _queryDest = dest;
+  _queryDestSize = len;
+  _queryExpected = script ? -1 : len;
+  _queryCount = 0;
+  _queryCallback = callback;
+  _queryTime = millis();
+  _queryState = QueryStatePending;
+  _querySent = false;
+  // Written directly so _streaming keeps following what the caller asked for
+  _queryPausedStream = _streaming;
+  if (_queryPausedStream)
+  {
+    _serial->write(150);
+    _serial->write(StreamCommandPause);
+  }
+  sendQueryWhenQuiet();
+}
+
+void Roomba::sendQueryWhenQuiet()
+{
+  if (_queryState != QueryStatePending || _querySent || _pollState != PollStateIdle)
+    return;
+  if (_queryPausedStream && millis() - _lastByteTime < ROOMBA_QUIET_TIME)
+    return;
+  _serial->write(_queryCommand, _queryCommandLen);
+  _querySent = true;
+  _queryTime = millis();
+}
+
+void Roomba::endQuery(bool success, uint8_t len)
+{
+  _queryState = success ? QueryStateComplete : QueryStateTimeout;
+  // Unless the stream was paused or stopped in the meantime
+  if (_queryPausedStream && _streaming)
+  {
+    _serial->write(150);
+    _serial->write(StreamCommandResume);
+  }
+  if (_queryCallback)
+    _queryCallback(success, _queryDest, len);
+}
+
+bool Roomba::queryByte(uint8_t ch)
+{
+  _queryTime = millis();
+  if (_queryExpected < 0)
+  {
+    // First byte of a script response is its length
+    if (ch > 100)
+    {
+      // Something wrong. Cant have such big scripts!!
+      endQuery(false, 0);
+      return false;
+    }
+    _queryExpected = ch;
+  }
+  else
+  {
+    if (_queryCount < _queryDestSize)
+      _queryDest[_queryCount] = ch;
+    _queryCount++;
+  }
+
+  if (_queryExpected >= 0 && _queryCount >= _queryExpected)
+  {
+    endQuery(true, min(_queryCount, _queryDestSize));
+    return true;
+  }
+  return false;
+}
+
+// Unlike getData(), the timeout is measured from the last byte of progress
+// and is safe across millis() rollover
+void Roomba::checkQueryTimeout()
+{
+  if (_queryState != QueryStatePending)
+    return;
+  if (millis() - _queryTime > ROOMBA_READ_TIMEOUT)
+  {
+    endQuery(false, min(_queryCount, _queryDestSize));
+  }
+}
+
+void Roomba::setReceiveCallback(ReceiveCallback callback)
+{
+  _receiveCallback = callback;
+}
+
+uint8_t Roomba::readByte()
+{
+  uint8_t ch = _serial->read();
+  _lastByteTime = millis();
+  if (_receiveCallback)
+    _receiveCallback(ch);
+  return ch;
+}
+
+bool Roomba::pollQuery()
+{
+  checkQueryTimeout();
+  sendQueryWhenQuiet();
+  while (_queryState == QueryStatePending && _serial->available())
+  {
+    if (queryByte(readByte()))
+      return true;
+  }
+  return false;
+}
+
+Roomba::QueryState Roomba::queryState()
+{
+  checkQueryTimeout();
+  return (QueryState)_queryState;
+}
+
+uint8_t Roomba::queryLength()
+{
+  return min(_queryCount, _queryDestSize);
+}
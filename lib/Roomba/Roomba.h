@@ -129,6 +129,15 @@
 /// If we have to wait more than this to read a char when we are expecting one, then something is wrong.
 #define ROOMBA_READ_TIMEOUT 200
 
+/// \def ROOMBA_QUIET_TIME
+/// Time in milliseconds without received bytes after which a paused stream is considered drained.
+/// Longer than the 15ms interval between stream packets.
+#define ROOMBA_QUIET_TIME 30
+
+/// \def ROOMBA_MAX_QUERY_IDS
+/// Maximum number of packet IDs that can be requested with getSensorsListAsync().
+#define ROOMBA_MAX_QUERY_IDS 16
+
 // You may be able to set this so you can use Roomba with NewSoftSerial
 // instead of HardwareSerial
 //#define HardwareSerial NewSoftSerial
@@ -199,6 +208,26 @@
 class Roomba
 {
 public:
+    /// \enum QueryState
+    /// Values returned by Roomba::queryState()
+    typedef enum
+    {
+	QueryStateIdle     = 0,
+	QueryStatePending  = 1,
+	QueryStateComplete = 2,
+	QueryStateTimeout  = 3,
+    } QueryState;
+
+    /// Completion callback for the asynchronous query functions.
+    /// \param[in] success true if the whole response was received, false on timeout
+    /// \param[in] dest The destination buffer passed when the query was issued
+    /// \param[in] len Number of bytes stored in dest
+    typedef void (*QueryCallback)(bool success, uint8_t* dest, uint8_t len);
+
+    /// Called with every byte read from the Roomba, see setReceiveCallback()
+    /// \param[in] ch The byte read
+    typedef void (*ReceiveCallback)(uint8_t ch);
+
     /// \enum Baud
     /// Demo types to pass to Roomba::baud()
     typedef enum
@@ -391,6 +420,8 @@ public:
 	SensorLeftVelocity             = 42,
     SensorLeftEncoderCounts        = 43,
     SensorRightEncoderCounts       = 44,
+    SensorLeftMotorCurrent         = 54,
+    SensorRightMotorCurrent        = 55,
     SensorStasis                   = 58,
     } Sensor;
 
@@ -601,6 +632,7 @@ public:
 
     /// Low level funciton to read len bytes of data from the Roomba
     /// Blocks untill all len bytes are read or a read timeout occurs.
+    /// Prefer the asynchronous query functions such as getSensorsAsync() in a busy main loop.
     /// \param[out] dest Destination where the read data is stored. Must have at least len bytes available.
     /// \param[in] len Number of bytes to read
     /// \return true if all len bytes were successfully read. Returns false in the case of a timeout 
@@ -654,6 +686,57 @@ public:
     /// \return The actual number of bytes in the script, even if this is more than len. By calling 
     /// getScript(NULL, 0), you can determine how many bytes would be required to store the script.
     uint8_t getScript(uint8_t* dest, uint8_t len);
+
+    /// Asynchronous version of getSensors(). Sends the query and returns immediately.
+    /// The response is collected by pollSensors() (or pollQuery() if no stream is active), so it can be
+    /// used while a stream requested with stream() is running. Since a response can't be told apart from
+    /// stream data, the stream is paused first and the query is only sent once it has gone quiet for
+    /// ROOMBA_QUIET_TIME. The stream is resumed when the query completes or times out.
+    /// Only one query can be outstanding at a time.
+    /// \param[in] packetID The ID of the sensor packet to read from Roomba::Sensor
+    /// \param[out] dest Destination where the read data is stored. Must stay valid until the query completes.
+    /// \param[in] len Number of sensor data bytes to read
+    /// \param[in] callback Optional function called when the query completes or times out
+    /// \return true if the query was sent, false if another query is still pending
+    bool getSensorsAsync(uint8_t packetID, uint8_t* dest, uint8_t len, QueryCallback callback = NULL);
+
+    /// Asynchronous version of getSensorsList(). See getSensorsAsync().
+    /// Create only. No equivalent on Roomba.
+    /// \param[in] packetIDs Array of IDs from Roomba::Sensor of the sensor packets to read
+    /// \param[in] numPacketIDs number of IDs in the packetIDs array. At most ROOMBA_MAX_QUERY_IDS
+    /// \param[out] dest Destination where the read data is stored. Must stay valid until the query completes.
+    /// \param[in] len Number of sensor data bytes to read and store to dest.
+    /// \param[in] callback Optional function called when the query completes or times out
+    /// \return true if the query was sent, false if another query is still pending
+    bool getSensorsListAsync(uint8_t* packetIDs, uint8_t numPacketIDs, uint8_t* dest, uint8_t len, QueryCallback callback = NULL);
+
+    /// Asynchronous version of getScript(). See getSensorsAsync().
+    /// Create only. No equivalent on Roomba.
+    /// \param[out] dest Destination where the script is stored. Must stay valid until the query completes.
+    /// \param[in] len The maximum number of bytes to place in dest.
+    /// \param[in] callback Optional function called when the query completes or times out. Its len
+    /// argument is the number of script bytes stored in dest.
+    /// \return true if the query was sent, false if another query is still pending
+    bool getScriptAsync(uint8_t* dest, uint8_t len, QueryCallback callback = NULL);
+
+    /// Reads any available serial data belonging to an outstanding asynchronous query.
+    /// Never blocks. Use this instead of pollSensors() when no stream is active.
+    /// \return true when the outstanding query has just completed successfully
+    bool pollQuery();
+
+    /// Returns the state of the most recent asynchronous query. Once a query has completed or timed out
+    /// its state stays QueryStateComplete or QueryStateTimeout until the next query is issued.
+    /// \return One of Roomba::QueryState
+    QueryState queryState();
+
+    /// Returns the number of bytes received so far for the most recent asynchronous query
+    uint8_t queryLength();
+
+    /// Sets a function to be called with every byte read from the Roomba, by any function,
+    /// before it is interpreted. Useful to capture the raw data. Called from the reading
+    /// functions, so it must be quick.
+    /// \param[in] callback The function to call, NULL to stop calling it
+    void setReceiveCallback(ReceiveCallback callback);
   
 private:
     /// \enum PollState
@@ -678,6 +761,45 @@ private:
     uint8_t         _pollCount; /// Num of bytes read so far
     uint8_t         _pollChecksum; /// Running checksum counter of data bytes + count
 
+    /// Reads one byte from the serial port and passes it to the receive callback.
+    /// Caller must ensure a byte is available.
+    uint8_t readByte();
+
+    /// Called with every byte read, may be NULL
+    ReceiveCallback _receiveCallback;
+
+    /// Starts an asynchronous query, pausing a running stream first
+    void beginQuery(const uint8_t* command, uint8_t commandLen, uint8_t* dest, uint8_t len, bool script, QueryCallback callback);
+
+    /// Sends the command of the pending query once the stream is quiet
+    void sendQueryWhenQuiet();
+
+    /// Finishes the pending query, resumes the stream and calls the callback
+    void endQuery(bool success, uint8_t len);
+
+    /// Stores one byte of an asynchronous query response
+    /// \return true if the query has just completed
+    bool queryByte(uint8_t ch);
+
+    /// Checks the outstanding asynchronous query for a timeout
+    void checkQueryTimeout();
+
+    /// Variables for keeping track of asynchronous queries
+    uint8_t         _queryState;    /// Current state of the query, one of Roomba::QueryState
+    uint8_t*        _queryDest;     /// Where to store the response
+    uint8_t         _queryDestSize; /// Max number of bytes to store to _queryDest
+    int16_t         _queryExpected; /// Num of bytes expected, -1 while waiting for a script length
+    uint8_t         _queryCount;    /// Num of bytes read so far
+    QueryCallback   _queryCallback; /// Called when the query completes or times out
+    unsigned long   _queryTime;     /// millis() of the last progress on the query
+    uint8_t         _queryCommand[ROOMBA_MAX_QUERY_IDS + 2]; /// Sent once the stream is quiet
+    uint8_t         _queryCommandLen;
+    bool            _querySent;     /// The command has been sent, following bytes are the response
+    bool            _queryPausedStream; /// The stream was paused for this query
+
+    bool            _streaming;     /// A stream was requested and not paused
+    unsigned long   _lastByteTime;  /// millis() of the last byte received
+
 };
 
 #endif
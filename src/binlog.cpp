@@ -0,0 +1,88 @@
+#include "binlog.h"
+
+static uint8_t buffer[BINLOG_BUFFER_SIZE];
+// Oldest record starts at tail, next record is written at head
+static size_t head = 0;
+static size_t tail = 0;
+static size_t used = 0;
+static uint32_t dropped = 0;
+
+#ifdef ESP32
+// The ingest task logs too, and it preempts the loop
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+#define BINLOG_LOCK() portENTER_CRITICAL(&lock)
+#define BINLOG_UNLOCK() portEXIT_CRITICAL(&lock)
+#else
+// Tickers only run when the loop yields, never inside these functions
+#define BINLOG_LOCK()
+#define BINLOG_UNLOCK()
+#endif
+
+static uint8_t peek(size_t offset) {
+  return buffer[(tail + offset) % BINLOG_BUFFER_SIZE];
+}
+
+static size_t recordSize(size_t offset) {
+  return BINLOG_HEADER_SIZE + peek(offset + 2) * 4 + peek(offset + 3);
+}
+
+static void put(const uint8_t *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    buffer[head] = data[i];
+    head = (head + 1) % BINLOG_BUFFER_SIZE;
+  }
+  used += length;
+}
+
+void binlogWrite(uint16_t id, const int32_t *args, uint8_t argc, const uint8_t *blob, uint8_t blobLength) {
+  if (blobLength > BINLOG_MAX_BLOB) {
+    blobLength = BINLOG_MAX_BLOB;
+  }
+  size_t size = BINLOG_HEADER_SIZE + argc * 4 + blobLength;
+
+  BINLOG_LOCK();
+  // Make room by dropping the oldest records
+  while (BINLOG_BUFFER_SIZE - used < size) {
+    size_t oldest = recordSize(0);
+    tail = (tail + oldest) % BINLOG_BUFFER_SIZE;
+    used -= oldest;
+    dropped++;
+  }
+
+  uint32_t now = millis();
+  uint8_t header[BINLOG_HEADER_SIZE] = {
+    (uint8_t)id, (uint8_t)(id >> 8), argc, blobLength,
+    (uint8_t)now, (uint8_t)(now >> 8), (uint8_t)(now >> 16), (uint8_t)(now >> 24)
+  };
+  put(header, sizeof(header));
+  for (uint8_t i = 0; i < argc; i++) {
+    uint8_t arg[4] = {
+      (uint8_t)args[i], (uint8_t)(args[i] >> 8), (uint8_t)(args[i] >> 16), (uint8_t)(args[i] >> 24)
+    };
+    put(arg, sizeof(arg));
+  }
+  put(blob, blobLength);
+  BINLOG_UNLOCK();
+}
+
+size_t binlogRead(uint8_t *dest, size_t length) {
+  size_t copied = 0;
+  BINLOG_LOCK();
+  while (used > 0) {
+    size_t size = recordSize(0);
+    if (copied + size > length) {
+      break;
+    }
+    for (size_t i = 0; i < size; i++) {
+      dest[copied++] = peek(i);
+    }
+    tail = (tail + size) % BINLOG_BUFFER_SIZE;
+    used -= size;
+  }
+  BINLOG_UNLOCK();
+  return copied;
+}
+
+uint32_t binlogDropped() {
+  return dropped;
+}
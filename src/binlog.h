@@ -0,0 +1,54 @@
+// Deferred binary logging
+//
+// Log sites record a 16 bit ID (a hash of the format string) plus the raw
+// integer arguments into a RAM ring buffer. No formatting happens on the
+// device: the buffer is drained over telnet or MQTT and formatted on the
+// host by tools/binlog_decode.py, which rebuilds the ID -> format string
+// table from the sources.
+//
+// Record layout, little endian:
+//   uint16 id, uint8 argc, uint8 blob length, uint32 millis,
+//   argc * int32 arguments, blob bytes
+#ifndef binlog_h
+#define binlog_h
+
+#include <Arduino.h>
+
+#define BINLOG_BUFFER_SIZE 2048
+#define BINLOG_MAX_ARGS 16
+#define BINLOG_MAX_BLOB 150
+#define BINLOG_HEADER_SIZE 8
+// Largest record, a buffer for binlogRead() has to hold at least one
+#define BINLOG_MAX_RECORD (BINLOG_HEADER_SIZE + BINLOG_MAX_ARGS * 4 + BINLOG_MAX_BLOB)
+
+// FNV-1a of the format string folded to 16 bits. Must match binlog_decode.py.
+constexpr uint16_t binlogFold(uint32_t h) {
+  return (uint16_t)(h ^ (h >> 16));
+}
+constexpr uint16_t binlogHash(const char *s, uint32_t h = 2166136261u) {
+  return *s ? binlogHash(s + 1, (h ^ (uint8_t)*s) * 16777619u) : binlogFold(h);
+}
+
+void binlogWrite(uint16_t id, const int32_t *args, uint8_t argc, const uint8_t *blob, uint8_t blobLength);
+
+// Copies as many whole records as fit into dest and removes them from the buffer.
+// Returns the number of bytes copied. A record that doesn't fit into length
+// stays at the head, so length must be at least BINLOG_MAX_RECORD.
+size_t binlogRead(uint8_t *dest, size_t length);
+
+// Number of records overwritten before they could be drained
+uint32_t binlogDropped();
+
+template<typename... Args>
+inline void binlog(uint16_t id, Args... args) {
+  static_assert(sizeof...(args) <= BINLOG_MAX_ARGS, "Too many binlog arguments");
+  const int32_t values[] = {0, (int32_t)args...};
+  binlogWrite(id, values + 1, sizeof...(args), NULL, 0);
+}
+
+// Records msg and its integer arguments
+#define BLOG(msg, ...) do { constexpr uint16_t _binlogId = binlogHash(msg); binlog(_binlogId, ##__VA_ARGS__); } while (0)
+// Records msg followed by a dump of length bytes of data
+#define BLOG_BYTES(msg, data, length) do { constexpr uint16_t _binlogId = binlogHash(msg); binlogWrite(_binlogId, NULL, 0, data, length); } while (0)
+
+#endif
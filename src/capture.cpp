@@ -0,0 +1,165 @@
+#include "capture.h"
+
+static uint8_t buffer[CAPTURE_BUFFER_SIZE];
+static size_t head = 0; // Next byte to write
+static size_t used = 0;
+
+// The record being received
+static uint8_t pending[CAPTURE_MAX_RECORD];
+static uint8_t pendingLength = 0;
+static unsigned long pendingTime;
+
+static bool running = false;
+static bool startPending = false;
+static bool endPending = false;
+static unsigned long startTime;
+static uint32_t captureDuration;
+static unsigned long lastRecordTime;
+static uint16_t sequence;
+static uint32_t dropped;
+
+#ifdef ESP32
+// captureByte() runs in the ingest task, which preempts the loop
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+#define CAPTURE_LOCK() portENTER_CRITICAL(&lock)
+#define CAPTURE_UNLOCK() portEXIT_CRITICAL(&lock)
+#else
+// Tickers only run when the loop yields, never inside these functions
+#define CAPTURE_LOCK()
+#define CAPTURE_UNLOCK()
+#endif
+
+static uint8_t peek(size_t offset) {
+  return buffer[(head + CAPTURE_BUFFER_SIZE - used + offset) % CAPTURE_BUFFER_SIZE];
+}
+
+static void put(uint8_t b) {
+  buffer[head] = b;
+  head = (head + 1) % CAPTURE_BUFFER_SIZE;
+  used++;
+}
+
+static void dropOldest() {
+  size_t size = CAPTURE_RECORD_HEADER_SIZE + peek(2);
+  dropped += size - CAPTURE_RECORD_HEADER_SIZE;
+  used -= size;
+}
+
+static void writePending() {
+  if (pendingLength == 0) {
+    return;
+  }
+  size_t size = CAPTURE_RECORD_HEADER_SIZE + pendingLength;
+  while (CAPTURE_BUFFER_SIZE - used < size) {
+    dropOldest();
+  }
+  uint16_t delta = min(pendingTime - lastRecordTime, 0xFFFFUL);
+  lastRecordTime = pendingTime;
+  put(delta & 0xFF);
+  put(delta >> 8);
+  put(pendingLength);
+  for (uint8_t i = 0; i < pendingLength; i++) {
+    put(pending[i]);
+  }
+  pendingLength = 0;
+}
+
+void captureStart(uint32_t duration) {
+  CAPTURE_LOCK();
+  head = 0;
+  used = 0;
+  pendingLength = 0;
+  sequence = 0;
+  dropped = 0;
+  startTime = millis();
+  lastRecordTime = startTime;
+  captureDuration = duration;
+  startPending = true;
+  endPending = false;
+  running = true;
+  CAPTURE_UNLOCK();
+}
+
+static void stop() {
+  if (!running) {
+    return;
+  }
+  writePending();
+  running = false;
+  endPending = true;
+}
+
+void captureStop() {
+  CAPTURE_LOCK();
+  stop();
+  CAPTURE_UNLOCK();
+}
+
+bool captureRunning() {
+  return running;
+}
+
+void captureByte(uint8_t ch) {
+  if (!running) {
+    return;
+  }
+  CAPTURE_LOCK();
+  unsigned long now = millis();
+  if (pendingLength == CAPTURE_MAX_RECORD || (pendingLength > 0 && now != pendingTime)) {
+    writePending();
+  }
+  if (pendingLength == 0) {
+    pendingTime = now;
+  }
+  pending[pendingLength++] = ch;
+  CAPTURE_UNLOCK();
+}
+
+void captureFlush(unsigned long now) {
+  if (!running) {
+    return;
+  }
+  CAPTURE_LOCK();
+  if (pendingLength > 0 && now != pendingTime) {
+    writePending();
+  }
+  if (captureDuration && now - startTime >= captureDuration) {
+    stop();
+  }
+  CAPTURE_UNLOCK();
+}
+
+size_t captureBuffered() {
+  return used;
+}
+
+size_t captureRead(uint8_t *dest, size_t length) {
+  if ((used == 0 && !endPending) || length < sizeof(CaptureChunkHeader) + CAPTURE_RECORD_HEADER_SIZE + CAPTURE_MAX_RECORD) {
+    return 0;
+  }
+  CAPTURE_LOCK();
+  CaptureChunkHeader header;
+  header.version = CAPTURE_VERSION;
+  header.flags = startPending ? CAPTURE_FLAG_START : 0;
+  header.sequence = sequence++;
+  header.dropped = dropped;
+  size_t copied = sizeof(header);
+  while (used > 0) {
+    size_t size = CAPTURE_RECORD_HEADER_SIZE + peek(2);
+    if (copied + size > length) {
+      break;
+    }
+    for (size_t i = 0; i < size; i++) {
+      dest[copied++] = peek(i);
+    }
+    used -= size;
+  }
+  if (used == 0 && endPending) {
+    header.flags |= CAPTURE_FLAG_END;
+    endPending = false;
+  }
+  startPending = false;
+  CAPTURE_UNLOCK();
+  memcpy(dest, &header, sizeof(header));
+  return copied;
+}
@@ -0,0 +1,53 @@
+// Serial capture
+//
+// Records the raw bytes received from the Roomba, with their timing, into a
+// RAM ring buffer while a capture is running, to be uploaded in chunks and
+// replayed on the host by tools/capture_replay.py.
+//
+// Bytes received in the same millisecond are grouped into one record:
+//   uint16 ms since the previous record (saturating), uint8 length, bytes
+// A chunk is a CaptureChunkHeader followed by whole records, little endian.
+// If the upload can't keep up, the oldest records are dropped and counted.
+#ifndef capture_h
+#define capture_h
+
+#include <Arduino.h>
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER_SIZE 4096
+#define CAPTURE_MAX_RECORD 64
+#define CAPTURE_RECORD_HEADER_SIZE 3
+
+#define CAPTURE_FLAG_START 0x1 // First chunk of a capture
+#define CAPTURE_FLAG_END 0x2   // Last chunk of a capture
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  uint8_t flags;
+  uint16_t sequence; // Chunk number within the capture
+  uint32_t dropped;  // Bytes dropped since the start of the capture
+} CaptureChunkHeader;
+
+// Starts a capture that stops by itself after duration ms, 0 to run until stopped
+void captureStart(uint32_t duration);
+
+void captureStop();
+
+bool captureRunning();
+
+// Roomba::ReceiveCallback
+void captureByte(uint8_t ch);
+
+// Moves the bytes received so far into the ring buffer and stops the capture
+// when its time is up. Call every loop.
+void captureFlush(unsigned long now);
+
+// Number of bytes waiting to be uploaded
+size_t captureBuffered();
+
+// Copies a chunk header and as many whole records as fit into dest and
+// removes them from the buffer. Returns the number of bytes used, 0 if
+// there is nothing to upload.
+size_t captureRead(uint8_t *dest, size_t length);
+
+#endif
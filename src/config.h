@@ -6,6 +6,162 @@
 
 #define ADC_VOLTAGE_DIVIDER 44.551316985
 //#define ENABLE_ADC_SLEEP
+// The ADC is sampled in the background, one sample per interval. Sampling too often disturbs WiFi.
+#define ADC_SAMPLE_INTERVAL_MS 50
+// ADC readings below this are treated as "divider not connected"
+#define ADC_MIN_VALID_MV 5000
+
+// The sensor stream is read and decoded at this interval, independent of the loop
+#define SENSOR_INGEST_INTERVAL_MS 5
+// ESP32 only: the ingest task runs on the application core, away from the WiFi
+// stack on core 0, and above the priority of the loop task (1)
+#define SENSOR_INGEST_TASK_CORE 1
+#define SENSOR_INGEST_TASK_PRIORITY 2
+#define SENSOR_INGEST_TASK_STACK 4096
+// Decoded frames waiting for the loop, a power of two. 16 frames are 240ms of stream.
+#define FRAME_RING_SIZE 16
+
+// Commands sent in a JSON envelope with an id are tracked until their effect shows up in the stream
+#define COMMAND_PENDING_MAX 4
+#define COMMAND_TIMEOUT_MS 10000
+#define COMMAND_DOCK_TIMEOUT_MS 600000
+// Commands are received with QoS 1 in a persistent session and queued, so ones published
+// while the device is offline are run in order after it reconnects
+#define COMMAND_QUEUE_LENGTH 8
+#define COMMAND_MAX_LENGTH 160
+// Redeliveries of the last this many commands are recognized by their packet ID
+#define COMMAND_RECENT_IDS 8
+
+// Local WebSocket endpoint pushing every decoded frame (see README)
+#define WEBSOCKET_PORT 81
+#define WEBSOCKET_MAX_CLIENTS 3
+// Fastest rate a client may ask for, and the default for new clients
+#define WEBSOCKET_MIN_INTERVAL_MS 15
+#define WEBSOCKET_DEFAULT_INTERVAL_MS 100
+
+// HTTP endpoint serving counters in the Prometheus text format on /metrics
+#define METRICS_PORT 80
+
+// Frames a bump, cliff, wheel drop or overcurrent must be clear for before it can fire again
+#define EVENT_RELEASE_FRAMES 2
+
+// Stuck and wheel slip detection. Encoder counts are summed over windows of
+// MOTION_WINDOW_MS and a condition is reported once it held for MOTION_ALERT_MS
+// (MOTION_SPIN_ALERT_MS for spinning, which the robot also does on purpose).
+#define MOTION_WINDOW_MS 250
+#define MOTION_ALERT_MS 500
+#define MOTION_SPIN_ALERT_MS 3000
+// Below this a wheel counts as not turning, per window
+#define MOTION_MIN_COUNTS 8
+// Wheel motor currents above which the wheels are driven, or stalled
+#define MOTION_DRIVE_CURRENT_MA 40
+#define MOTION_STALL_CURRENT_MA 500
+// Windows with a bump, out of the last 16, that mean the robot is trapped
+#define MOTION_BUMP_WINDOWS 8
+
+// How often changed coverage map tiles are published
+#define COVERAGE_PUBLISH_INTERVAL_MS 10000
+
+// Runtime predictor, sends the robot home while it can still make it back.
+// Charge kept in reserve, matching the low battery cutoff in sleepIfNecessary()
+#define RUNTIME_RESERVE_PERCENT 15
+// Current average over about 2^RUNTIME_CURRENT_SHIFT frames (~15s)
+#define RUNTIME_CURRENT_SHIFT 10
+// Window over which the drop in charge is measured
+#define RUNTIME_CHARGE_WINDOW_MS 60000
+// No predictions until the robot has been off the dock this long
+#define RUNTIME_WARMUP_MS 30000
+// The robot wanders to find the dock's beam, so the way back is taken to be
+// this many times the straight line, up to the distance driven so far
+#define RUNTIME_RETURN_PATH_FACTOR 3
+#define RUNTIME_RETURN_SPEED_MM_S 150
+// Time to find the beam and line up with the dock
+#define RUNTIME_DOCK_SEARCH_S 60
+// Head home when runtime left drops below the return time times this, in 1/256
+#define RUNTIME_RETURN_MARGIN 384
+
+// Serial capture, started with the capture_start command (see README)
+#define CAPTURE_DEFAULT_MS 60000
+#define CAPTURE_CHUNK_SIZE 400
+#define CAPTURE_CHUNKS_PER_LOOP 4
+#define CAPTURE_UPLOAD_INTERVAL_MS 500
+
+// Number of OI song slots to use for melodies. Roomba 500/600 models have 5 (0-4), the Create 16.
+#define SONG_SLOT_COUNT 4
+
+// Defaults for the runtime settings, which can be changed by publishing JSON to
+// MQTT_CONFIG_TOPIC and are persisted to flash (see settings.h)
+#define STATUS_INTERVAL_MS 10000
+#define INFO_INTERVAL_MS 60000
+#define RECONNECT_INTERVAL_MS 30000
+// The Roomba state is considered stale if no frame arrived for this long
+#define STALE_THRESHOLD_MS 30000
+
+// Give up on the cached WiFi channel/BSSID and do a full scan after this long
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 5000
+// WiFi reconnect attempts: give each attempt this long, then back off exponentially
+#define WIFI_CONNECT_TIMEOUT_MS 15000
+#define WIFI_BACKOFF_MIN_MS 2000
+#define WIFI_BACKOFF_MAX_MS 60000
+
+// Resume normal operation if an OTA update makes no progress for this long
+#define OTA_STALL_TIMEOUT_MS 30000
+// Minimum time between OTA progress logs
+#define OTA_PROGRESS_INTERVAL_MS 2000
+
+// A loop stage taking longer than this is recorded as a stall (see watchdog.h)
+#define LOOP_STALL_THRESHOLD_MS 2000
+
+// Heap statistics are sampled at this interval to track their minima
+#define MEMORY_SAMPLE_INTERVAL_MS 1000
+
+// Power management policy, one of:
+// 0 = always on
+// 1 = WiFi modem sleep while idle on the dock
+// 2 = like 1, but also pause the sensor stream and use WiFi light sleep between status reports
+#define POWER_POLICY 1
+// Resume the stream this long before a status report is due (policy 2)
+#define POWER_STREAM_LEAD_MS 1000
+// Estimated ESP current draw per power state in mA, used for the energy model
+#define POWER_ACTIVE_MA 70
+#define POWER_MODEM_SLEEP_MA 16
+#define POWER_LIGHT_SLEEP_MA 3
+
+// Wake keeping: pulse BRC shortly before the Roomba is expected to fall asleep.
+// The interval starts at WAKE_INITIAL_INTERVAL_MS and adapts to observed sleeps.
+#define WAKE_INITIAL_INTERVAL_MS 50000
+#define WAKE_MIN_INTERVAL_MS 10000
+#define WAKE_MAX_INTERVAL_MS 240000
+// No stream frame for this long means the Roomba is asleep
+#define WAKE_FRAME_GAP_MS 3000
+// Don't pulse for this long after a command was sent
+#define WAKE_COMMAND_HOLDOFF_MS 5000
+
+// Speak MQTT 5 instead of 3.1.1 (see mqtt5.h). The hot topics use topic aliases,
+// retained telemetry expires after MQTT_TELEMETRY_EXPIRY_S and every message
+// carries a "schema" user property. Can also be set with -DMQTT5=1 in platformio.ini.
+#ifndef MQTT5
+#define MQTT5 0
+#endif
+#define MQTT_TELEMETRY_EXPIRY_S 900
+#define MQTT_SCHEMA_VERSION "1"
+
+// Connect to the broker with TLS (see tls.h). Needs MQTT_TLS_FINGERPRINT in secrets.h.
+// Can also be set with -DMQTT_TLS=1 in platformio.ini.
+#ifndef MQTT_TLS
+#define MQTT_TLS 0
+#endif
+#define MQTT_PORT 1883
+// Must not change between connects, the broker keeps the session under this ID
+#define MQTT_CLIENT_ID HOSTNAME
+// How long the broker keeps the session of a disconnected device (MQTT 5 only, 3.1.1 keeps it forever)
+#define MQTT_SESSION_EXPIRY_S 86400
+#define MQTT_TLS_PORT 8883
+// BearSSL record buffers, the broker is asked for fragments of at most TLS_RX_BUFFER_SIZE
+#define TLS_RX_BUFFER_SIZE 1024
+#define TLS_TX_BUFFER_SIZE 512
+// Room for the stream bytes arriving during key exchange steps that don't yield
+#define TLS_SERIAL_RX_BUFFER_SIZE 1024
 
 #define MQTT_COMMAND_TOPIC "vacuum/command"
 #define MQTT_STATE_TOPIC "vacuum/STATUS"
@@ -13,3 +169,11 @@
 #define MQTT_INFO_TOPIC "vacuum/INFO"
 #define MQTT_LWT_TOPIC "vacuum/LWT"
 #define MQTT_DEBUG_TOPIC "vacuum/DEBUG"
+#define MQTT_COMMAND_RESPONSE_TOPIC "vacuum/RESPONSE"
+#define MQTT_OTA_TOPIC "vacuum/OTA"
+#define MQTT_STALL_TOPIC "vacuum/STALL"
+#define MQTT_CONFIG_TOPIC "vacuum/config"
+#define MQTT_CONFIG_STATE_TOPIC "vacuum/CONFIG"
+#define MQTT_EVENT_TOPIC "vacuum/EVENT"
+#define MQTT_COVERAGE_TOPIC "vacuum/COVERAGE"
+#define MQTT_CAPTURE_TOPIC "vacuum/CAPTURE"
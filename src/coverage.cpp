@@ -0,0 +1,171 @@
+#include "coverage.h"
+
+// Roomba 600 wheels are 72mm across with 508.8 counts per revolution and 235mm apart
+#define COVERAGE_UM_PER_COUNT 445
+// Heading change per count of difference between the wheels, in 1/64 of a heading unit
+#define COVERAGE_TURN_PER_COUNT 1263
+
+// sin() of the first quarter in 64 steps, Q14
+static const int16_t quarterSine[65] = {
+  0, 402, 804, 1205, 1606, 2006, 2404, 2801, 3196, 3590, 3981, 4370, 4756,
+  5139, 5520, 5897, 6270, 6639, 7005, 7366, 7723, 8076, 8423, 8765, 9102, 9434,
+  9760, 10080, 10394, 10702, 11003, 11297, 11585, 11866, 12140, 12406, 12665, 12916, 13160,
+  13395, 13623, 13842, 14053, 14256, 14449, 14635, 14811, 14978, 15137, 15286, 15426, 15557,
+  15679, 15791, 15893, 15986, 16069, 16143, 16207, 16261, 16305, 16340, 16364, 16379, 16384,
+};
+
+static uint8_t visited[COVERAGE_TILES * COVERAGE_TILES][COVERAGE_TILE_SIZE];
+static uint8_t obstacles[COVERAGE_TILES * COVERAGE_TILES][COVERAGE_TILE_SIZE];
+static uint64_t dirtyTiles;
+static bool resetPending;
+static uint16_t visitedCells;
+
+static int32_t x; // um
+static int32_t y;
+static uint32_t heading; // In 1/64 of a heading unit
+static int16_t lastCellX;
+static int16_t lastCellY;
+
+static_assert(COVERAGE_TILES * COVERAGE_TILES <= 64, "Dirty tiles don't fit in 64 bits");
+
+// Q14, angle in 256 steps per revolution
+static int32_t sine(uint8_t angle) {
+  uint8_t step = angle & 63;
+  switch (angle >> 6) {
+    case 0: return quarterSine[step];
+    case 1: return quarterSine[64 - step];
+    case 2: return -quarterSine[step];
+    default: return -quarterSine[64 - step];
+  }
+}
+
+// Rounds towards negative infinity, so cells left of the origin don't get merged
+static int16_t cellOf(int32_t um) {
+  int32_t cellUm = COVERAGE_CELL_MM * 1000;
+  return (um >= 0 ? um / cellUm : (um - cellUm + 1) / cellUm) + COVERAGE_GRID_SIZE / 2;
+}
+
+static void mark(uint8_t plane[][COVERAGE_TILE_SIZE], int16_t cx, int16_t cy) {
+  if (cx < 0 || cy < 0 || cx >= COVERAGE_GRID_SIZE || cy >= COVERAGE_GRID_SIZE) {
+    return;
+  }
+  uint8_t tile = cy / COVERAGE_TILE_SIZE * COVERAGE_TILES + cx / COVERAGE_TILE_SIZE;
+  uint8_t &row = plane[tile][cy % COVERAGE_TILE_SIZE];
+  uint8_t bit = 1 << (cx % COVERAGE_TILE_SIZE);
+  if (row & bit) {
+    return;
+  }
+  row |= bit;
+  dirtyTiles |= (uint64_t)1 << tile;
+  if (plane == visited) {
+    visitedCells++;
+  }
+}
+
+void coverageReset() {
+  memset(visited, 0, sizeof(visited));
+  memset(obstacles, 0, sizeof(obstacles));
+  dirtyTiles = 0;
+  resetPending = true;
+  visitedCells = 0;
+  x = 0;
+  y = 0;
+  heading = 0;
+  lastCellX = -1;
+  lastCellY = -1;
+}
+
+void coverageUpdate(int16_t leftCounts, int16_t rightCounts, bool bumped) {
+  // Midpoint of the turn, which is plenty at 15ms per frame
+  int32_t turn = (int32_t)(rightCounts - leftCounts) * COVERAGE_TURN_PER_COUNT;
+  uint8_t angle = (uint16_t)((heading + turn / 2) >> 6) >> 8;
+  heading += turn;
+  int32_t distance = (int32_t)(leftCounts + rightCounts) * COVERAGE_UM_PER_COUNT / 2;
+  x += (int64_t)distance * sine(angle + 64) >> 14;
+  y += (int64_t)distance * sine(angle) >> 14;
+
+  int16_t cx = cellOf(x);
+  int16_t cy = cellOf(y);
+  if (cx != lastCellX || cy != lastCellY) {
+    lastCellX = cx;
+    lastCellY = cy;
+    for (int dy = -COVERAGE_FOOTPRINT_RADIUS; dy <= COVERAGE_FOOTPRINT_RADIUS; dy++) {
+      for (int dx = -COVERAGE_FOOTPRINT_RADIUS; dx <= COVERAGE_FOOTPRINT_RADIUS; dx++) {
+        mark(visited, cx + dx, cy + dy);
+      }
+    }
+  }
+  if (bumped) {
+    angle = (uint16_t)(heading >> 6) >> 8;
+    int64_t reach = COVERAGE_BUMPER_MM * 1000;
+    mark(obstacles, cellOf(x + (reach * sine(angle + 64) >> 14)), cellOf(y + (reach * sine(angle) >> 14)));
+  }
+}
+
+size_t coverageRead(uint8_t *buffer, size_t length) {
+  if ((!dirtyTiles && !resetPending) || length < sizeof(CoverageHeader) + 2 + 2 * COVERAGE_TILE_SIZE) {
+    return 0;
+  }
+  CoverageHeader header;
+  header.version = COVERAGE_VERSION;
+  header.flags = resetPending ? COVERAGE_FLAG_RESET : 0;
+  header.gridSize = COVERAGE_GRID_SIZE;
+  header.tileSize = COVERAGE_TILE_SIZE;
+  header.cellMm = COVERAGE_CELL_MM;
+  header.x = x / 1000;
+  header.y = y / 1000;
+  header.heading = heading >> 6;
+  memcpy(buffer, &header, sizeof(header));
+  resetPending = false;
+
+  size_t used = sizeof(header);
+  for (uint8_t tile = 0; tile < COVERAGE_TILES * COVERAGE_TILES; tile++) {
+    if (!(dirtyTiles & ((uint64_t)1 << tile))) {
+      continue;
+    }
+    if (used + 2 + 2 * COVERAGE_TILE_SIZE > length) {
+      break;
+    }
+    uint8_t *entry = buffer + used;
+    entry[0] = tile;
+    entry[1] = 0;
+    used += 2;
+    uint8_t (*planes[2])[COVERAGE_TILE_SIZE] = {visited, obstacles};
+    for (uint8_t p = 0; p < 2; p++) {
+      uint8_t *rows = planes[p][tile];
+      bool empty = true;
+      for (uint8_t r = 0; r < COVERAGE_TILE_SIZE; r++) {
+        empty &= rows[r] == 0;
+      }
+      if (!empty) {
+        entry[1] |= 1 << p;
+        memcpy(buffer + used, rows, COVERAGE_TILE_SIZE);
+        used += COVERAGE_TILE_SIZE;
+      }
+    }
+    dirtyTiles &= ~((uint64_t)1 << tile);
+  }
+  return used;
+}
+
+uint16_t coverageVisitedCells() {
+  return visitedCells;
+}
+
+uint32_t coverageDistanceFromStart() {
+  // Capped so the square fits, 40m is far beyond any run
+  uint32_t dx = min(abs(x / 1000), (int32_t)40000);
+  uint32_t dy = min(abs(y / 1000), (int32_t)40000);
+  uint32_t square = dx * dx + dy * dy;
+  // Integer square root, one bit at a time
+  uint32_t root = 0;
+  for (uint32_t bit = 1UL << 30; bit; bit >>= 2) {
+    if (square >= root + bit) {
+      square -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  }
+  return root;
+}
@@ -0,0 +1,57 @@
+// Coverage map
+//
+// Dead-reckons the robot's pose from the wheel encoders and marks the
+// cells it drove over, and the cells it bumped into, in two bit planes of
+// a fixed grid centered on where the run started. The grid is stored as
+// square tiles so changed tiles can be exported as they are.
+//
+// Export format, little endian: a CoverageHeader followed by tiles of
+//   uint8 tile index (row major), uint8 planes (bit 0 visited, bit 1 obstacle),
+//   8 bytes per plane present, byte n is row n of the tile, bit n column n.
+// Tiles without any bit set in a plane leave that plane out.
+#ifndef coverage_h
+#define coverage_h
+
+#include <Arduino.h>
+
+#define COVERAGE_VERSION 1
+#define COVERAGE_GRID_SIZE 64 // Cells per side
+#define COVERAGE_CELL_MM 100
+#define COVERAGE_TILE_SIZE 8 // Cells per side, one byte per row
+#define COVERAGE_TILES (COVERAGE_GRID_SIZE / COVERAGE_TILE_SIZE)
+// Cells marked around the robot's center, the robot is about 340mm wide
+#define COVERAGE_FOOTPRINT_RADIUS 1
+// Distance from the center to the bumper, where obstacles are marked
+#define COVERAGE_BUMPER_MM 170
+
+#define COVERAGE_FLAG_RESET 0x1 // First chunk of a new map
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  uint8_t flags;
+  uint8_t gridSize;
+  uint8_t tileSize;
+  uint16_t cellMm;
+  int16_t x; // mm from the start of the run
+  int16_t y;
+  uint16_t heading; // 65536 per revolution, counter clockwise
+} CoverageHeader;
+
+// Clears the map and puts the robot at the origin
+void coverageReset();
+
+// Moves the robot by the encoder counts since the previous frame. Marks the
+// cell in front of it as an obstacle if it bumped.
+void coverageUpdate(int16_t leftCounts, int16_t rightCounts, bool bumped);
+
+// Copies the header and as many changed tiles as fit into buffer, and marks
+// them as exported. Returns the number of bytes used, 0 if nothing changed.
+size_t coverageRead(uint8_t *buffer, size_t length);
+
+// Number of visited cells
+uint16_t coverageVisitedCells();
+
+// Straight line distance in mm from the start of the run
+uint32_t coverageDistanceFromStart();
+
+#endif
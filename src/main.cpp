@@ -5,17 +5,35 @@
 #include <Roomba.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
+#include <WebSocketsServer.h>
 #include "config.h"
+#include "settings.h"
+#include "watchdog.h"
+#include "metrics.h"
+#include "coverage.h"
+#include "capture.h"
+#include "sensors.h"
+#if MQTT5
+#include "mqtt5.h"
+#endif
+#include <Ticker.h>
+#include "spscring.h"
+#if MQTT_TLS
+#include "tls.h"
+#endif
 extern "C" {
 #include "user_interface.h"
 }
 
 // Remote debugging over telnet. Just run:
 // `telnet roomba.local` OR `nc roomba.local 23`
+// Verbose logs are recorded in binary form (see binlog.h) and can be
+// drained with the `binlog` telnet command or the `dump_log` MQTT command.
 #if LOGGING
 #include <RemoteDebug.h>
+#include "binlog.h"
 #define DLOG(msg, ...) if(Debug.isActive(Debug.DEBUG)){Debug.printf(msg, ##__VA_ARGS__);}
-#define VLOG(msg, ...) if(Debug.isActive(Debug.VERBOSE)){Debug.printf(msg, ##__VA_ARGS__);}
+#define VLOG(msg, ...) BLOG(msg, ##__VA_ARGS__)
 RemoteDebug Debug;
 #else
 #define DLOG(msg, ...)
@@ -25,58 +43,137 @@ RemoteDebug Debug;
 Roomba roomba(&Serial, Roomba::Baud115200);
 
 // Roomba state
+RoombaState roombaState = {};
+
+// Derived metrics
+// Computed once per accepted frame, and only when their inputs changed, so
+// publishers and policies read them instead of redoing the math.
+typedef enum {
+  DerivedBatteryPercent = 0x1,
+  DerivedCharging = 0x2,
+  DerivedOnDock = 0x4,
+} DerivedMetric;
+
 typedef struct {
-  // Sensor values
+  int16_t batteryPercent; // charge / capacity, can be off scale if the charge counter is
+  bool charging;
+  bool onDock; // On the home base, unlike RoombaState::docked which follows the current
+  uint8_t changed; // DerivedMetric bits of the values that changed with the last frame
+  bool valid;
+} DerivedState;
+
+DerivedState derived = {};
+
+void updateDerived(const RoombaState &previous, const RoombaState &state) {
+  uint8_t changed = 0;
+  bool all = !derived.valid;
+  if (all || state.charge != previous.charge || state.capacity != previous.capacity) {
+    int16_t percent = state.capacity ? (int32_t)state.charge * 100 / state.capacity : 0;
+    if (all || percent != derived.batteryPercent) {
+      derived.batteryPercent = percent;
+      changed |= DerivedBatteryPercent;
+    }
+  }
+  if (all || state.chargingState != previous.chargingState) {
+    bool charging = state.chargingState == Roomba::ChargeStateReconditioningCharging
+      || state.chargingState == Roomba::ChargeStateFullCharging
+      || state.chargingState == Roomba::ChargeStateTrickleCharging;
+    if (all || charging != derived.charging) {
+      derived.charging = charging;
+      changed |= DerivedCharging;
+    }
+  }
+  if (all || state.chargingSourcesAvailable != previous.chargingSourcesAvailable) {
+    bool onDock = state.chargingSourcesAvailable & ROOMBA_MASK_HOME_BASE;
+    if (all || onDock != derived.onDock) {
+      derived.onDock = onDock;
+      changed |= DerivedOnDock;
+    }
+  }
+  derived.changed = changed;
+  derived.valid = true;
+}
+
+// Local live state
+// Every accepted frame is pushed to WebSocket clients as a LiveFrame, rate limited per
+// client. Clients can change their rate by sending "interval=<ms>".
+typedef struct __attribute__((packed)) {
+  uint8_t version; // 1
+  uint32_t timestamp;
   int16_t distance;
   uint8_t chargingState;
   uint16_t voltage;
   int16_t current;
-  // Supposedly unsigned according to the OI docs, but I've seen it
-  // underflow to ~65000mAh, so I think signed will work better.
   int16_t charge;
   uint16_t capacity;
-  int16_t temp;
+  int8_t temp;
   uint8_t chargingSourcesAvailable;
   uint8_t OIMode;
-
   int16_t leftencodercounts;
   int16_t rightencodercounts;
   uint8_t stasis;
+  uint8_t flags; // bit 0 cleaning, bit 1 docked, bit 2 returning
+} LiveFrame;
 
-  // Derived state
-  bool cleaning;
-  bool docked;
-  bool returning;
-
-  int timestamp;
-  bool sent;
-} RoombaState;
-
-RoombaState roombaState = {};
+WebSocketsServer webSocket(WEBSOCKET_PORT);
+bool webSocketConnected[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint16_t webSocketInterval[WEBSOCKETS_SERVER_CLIENT_MAX];
+unsigned long webSocketLastSend[WEBSOCKETS_SERVER_CLIENT_MAX];
+uint8_t webSocketClientCount = 0;
 
 // Roomba sensor packet
 uint8_t roombaPacket[150];
-uint8_t sensors[] = {
-  Roomba::SensorDistance, // PID 19, 2 bytes, mm, signed
-  Roomba::SensorChargingState, // PID 21, 1 byte
-  Roomba::SensorVoltage, // PID 22, 2 bytes, mV, unsigned
-  Roomba::SensorCurrent, // PID 23, 2 bytes, mA, signed
-  Roomba::SensorBatteryTemperature, // PID 24, 1 byte, signed
-  Roomba::SensorBatteryCharge, // PID 25, 2 bytes, mAh, unsigned
-  Roomba::SensorBatteryCapacity, // PID 26, 2 bytes, mAh, unsigned
-  Roomba::SensorChargingSourcesAvailable, // PID 34, 1 byte, unsigned
-  Roomba::SensorOIMode, // PID 35, 1 byte, unsigned
-  Roomba::SensorLeftEncoderCounts, // PID 43, 2 bytes, signed
-  Roomba::SensorRightEncoderCounts, // PID 44, 2 bytes, signed
-  Roomba::SensorStasis // PID 58, 1 byte, unsigned
-};
+// Data bytes of each sensor packet the stream parser understands, 0 if unsupported.
+// The streamed sensors are part of the runtime settings.
+uint8_t sensorPacketSize(uint8_t packetID) {
+  switch (packetID) {
+    case Roomba::SensorBumpsAndWheelDrops:
+    case Roomba::SensorCliffLeft:
+    case Roomba::SensorCliffFrontLeft:
+    case Roomba::SensorCliffFrontRight:
+    case Roomba::SensorCliffRight:
+    case Roomba::SensorVirtualWall:
+    case Roomba::SensorOvercurrents:
+    case Roomba::SensorChargingState:
+    case Roomba::SensorBatteryTemperature:
+    case Roomba::SensorChargingSourcesAvailable:
+    case Roomba::SensorOIMode:
+    case Roomba::SensorStasis:
+      return 1;
+    case Roomba::SensorDistance:
+    case Roomba::SensorVoltage:
+    case Roomba::SensorCurrent:
+    case Roomba::SensorBatteryCharge:
+    case Roomba::SensorBatteryCapacity:
+    case Roomba::SensorLeftEncoderCounts:
+    case Roomba::SensorRightEncoderCounts:
+    case Roomba::SensorLeftMotorCurrent:
+    case Roomba::SensorRightMotorCurrent:
+      return 2;
+    default:
+      return 0;
+  }
+}
 
 // Network setup
+#if MQTT_TLS
+BearSSL::WiFiClientSecure wifiClient;
+#else
 WiFiClient wifiClient;
+#endif
 bool OTAStarted;
+unsigned long otaStartTime;
+unsigned long otaProgressTime;
+unsigned long otaReportTime;
+unsigned int otaProgress;
+unsigned int otaTotal;
 
 // MQTT setup
+#if MQTT5
+MQTT5Client mqttClient(wifiClient);
+#else
 PubSubClient mqttClient(wifiClient);
+#endif
 const PROGMEM char *commandTopic = MQTT_COMMAND_TOPIC;
 const PROGMEM char *statusTopic = MQTT_STATE_TOPIC;
 const PROGMEM char *statusHATopic = MQTT_STATE_HA_TOPIC;
@@ -84,13 +181,329 @@ const PROGMEM char *infoTopic = MQTT_INFO_TOPIC;
 const PROGMEM char *lwtTopic = MQTT_LWT_TOPIC;
 const PROGMEM char *lwtMessage = "ONLINE";
 const PROGMEM char *debugTopic = MQTT_DEBUG_TOPIC;
+const PROGMEM char *commandResponseTopic = MQTT_COMMAND_RESPONSE_TOPIC;
+const PROGMEM char *otaTopic = MQTT_OTA_TOPIC;
+const PROGMEM char *stallTopic = MQTT_STALL_TOPIC;
+const PROGMEM char *configTopic = MQTT_CONFIG_TOPIC;
+const PROGMEM char *configStateTopic = MQTT_CONFIG_STATE_TOPIC;
+const PROGMEM char *eventTopic = MQTT_EVENT_TOPIC;
+const PROGMEM char *coverageTopic = MQTT_COVERAGE_TOPIC;
+const PROGMEM char *captureTopic = MQTT_CAPTURE_TOPIC;
+
+// WiFi link state, kept by updateWiFiLink()
+typedef enum {
+  LinkStateConnecting = 0,
+  LinkStateConnected = 1,
+  LinkStateBackoff = 2,
+} LinkState;
+
+uint8_t linkState = LinkStateConnecting;
+
+// Every publish goes through here. Without a link the socket may still look
+// connected and a write would block for the TCP timeout.
+bool mqttPublish(const char *topic, const uint8_t *payload, unsigned int length, bool retained = false) {
+  if (linkState != LinkStateConnected) {
+    metricsCount(MetricPublishesDropped);
+    return false;
+  }
+#if MQTT5
+  // Status that nobody refreshed for a while is meaningless
+  uint32_t expiry = topic == statusTopic || topic == statusHATopic || topic == infoTopic ? MQTT_TELEMETRY_EXPIRY_S : 0;
+  bool sent = mqttClient.publish(topic, payload, length, retained, expiry);
+#else
+  bool sent = mqttClient.publish(topic, payload, length, retained);
+#endif
+  metricsCount(sent ? MetricPublishesSent : MetricPublishesDropped);
+  if (!sent) {
+    // Fixed header, topic length and topic come on top of the payload
+    if (5 + 2 + strlen(topic) + length > MQTT_MAX_PACKET_SIZE) {
+      DLOG("Publish to %s dropped, %u bytes don't fit MQTT_MAX_PACKET_SIZE\n", topic, length);
+    } else {
+      DLOG("Publish to %s failed\n", topic);
+    }
+  }
+  return sent;
+}
+
+bool mqttPublish(const char *topic, const char *payload, bool retained = false) {
+  return mqttPublish(topic, (const uint8_t *)payload, strlen(payload), retained);
+}
+
+// Boot phase timings in ms since boot, 0 if not reached yet
+bool bootFastConnect = false; // The first connection used the cached channel and BSSID
+unsigned long bootWifiTime = 0;
+unsigned long bootMqttTime = 0;
+unsigned long bootFirstFrameTime = 0;
+unsigned long bootFirstPublishTime = 0;
+
+// Memory health, worst values since boot
+uint32_t heapFreeMin = 0xFFFFFFFF;
+uint32_t heapMaxBlockMin = 0xFFFFFFFF;
+uint8_t heapFragmentationMax = 0;
+unsigned long lastMemorySampleTime = 0;
+
+void sampleMemory(unsigned long now) {
+  if (now - lastMemorySampleTime < MEMORY_SAMPLE_INTERVAL_MS) {
+    return;
+  }
+  lastMemorySampleTime = now;
+  heapFreeMin = min(heapFreeMin, ESP.getFreeHeap());
+  heapMaxBlockMin = min(heapMaxBlockMin, ESP.getMaxFreeBlockSize());
+  heapFragmentationMax = max(heapFragmentationMax, ESP.getHeapFragmentation());
+}
+
+void addMemoryInfo(JsonObject &root) {
+  root["FreeHeap"] = ESP.getFreeHeap();
+  root["FreeHeapMin"] = heapFreeMin;
+  root["MaxFreeBlock"] = ESP.getMaxFreeBlockSize();
+  root["MaxFreeBlockMin"] = heapMaxBlockMin;
+  root["HeapFragmentation"] = ESP.getHeapFragmentation();
+  root["HeapFragmentationMax"] = heapFragmentationMax;
+  // Lowest free stack since boot, measured from the painted stack
+  root["FreeStackMin"] = ESP.getFreeContStack();
+}
 
 // miscellanous
 int32_t distanceSum;
 bool stop_wakeup = false;
 
+int lastStateMsgTime = 0;
+int lastInfoMsgTime = 0;
+int lastConnectTime = 0;
+unsigned long lastCoverageTime = 0;
+unsigned long lastCaptureTime = 0;
+
+// Power management
+typedef enum {
+  PowerStateActive = 0,
+  PowerStateModemSleep = 1,
+  PowerStateLightSleep = 2,
+  PowerStateCount
+} PowerState;
+
+typedef enum {
+  PowerPolicyAlwaysOn = 0,
+  PowerPolicyModemSleep = 1,
+  PowerPolicyLightSleep = 2,
+} PowerPolicy;
+
+const uint16_t powerStateCurrent[PowerStateCount] = {
+  POWER_ACTIVE_MA,
+  POWER_MODEM_SLEEP_MA,
+  POWER_LIGHT_SLEEP_MA
+};
+const char *powerStateNames[PowerStateCount] = {"active", "modemsleep", "lightsleep"};
+
+uint8_t powerState = PowerStateActive;
+bool streamPaused = false;
+unsigned long streamChangeTime = 0;
+// Time spent in each power state since boot or the last policy change, in ms
+uint32_t powerStateTime[PowerStateCount];
+unsigned long lastPowerUpdateTime = 0;
+
+void setStreamPaused(bool paused) {
+  if (paused == streamPaused) {
+    return;
+  }
+  DLOG("%s stream for power management\n", paused ? "Pause" : "Resume");
+  roomba.streamCommand(paused ? Roomba::StreamCommandPause : Roomba::StreamCommandResume);
+  streamPaused = paused;
+  streamChangeTime = millis();
+}
+
+void setPowerState(uint8_t state) {
+  if (state == powerState) {
+    return;
+  }
+  DLOG("Power state %s -> %s\n", powerStateNames[powerState], powerStateNames[state]);
+  switch (state) {
+    case PowerStateModemSleep:
+      WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+      break;
+    case PowerStateLightSleep:
+      WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
+      break;
+    default:
+      WiFi.setSleepMode(WIFI_NONE_SLEEP);
+      break;
+  }
+  powerState = state;
+}
+
+// The duty cycles of one policy say nothing about another
+void resetPowerStats(unsigned long now) {
+  memset(powerStateTime, 0, sizeof(powerStateTime));
+  lastPowerUpdateTime = now;
+}
+
+void updatePowerState(unsigned long now) {
+  powerStateTime[powerState] += now - lastPowerUpdateTime;
+  lastPowerUpdateTime = now;
+
+  bool idleOnDock = roombaState.docked && !roombaState.cleaning && !roombaState.returning;
+  if (!idleOnDock || settings.powerPolicy == PowerPolicyAlwaysOn) {
+    setStreamPaused(false);
+    setPowerState(PowerStateActive);
+  } else if (settings.powerPolicy == PowerPolicyModemSleep) {
+    setStreamPaused(false);
+    setPowerState(PowerStateModemSleep);
+  } else if (now - lastStateMsgTime > settings.statusInterval - POWER_STREAM_LEAD_MS || !roombaState.sent) {
+    // A status report is due soon (or the latest frame is unreported), so we need fresh frames.
+    // Light sleep would drop UART bytes, so stay in modem sleep while streaming.
+    setStreamPaused(false);
+    setPowerState(PowerStateModemSleep);
+  } else {
+    setStreamPaused(true);
+    setPowerState(PowerStateLightSleep);
+  }
+}
+
+// Adds the energy model and per state duty cycles to a telemetry payload
+void addPowerInfo(JsonObject &root) {
+  uint32_t total = 0;
+  uint64_t charge = 0;
+  for (int i = 0; i < PowerStateCount; i++) {
+    total += powerStateTime[i];
+    charge += (uint64_t)powerStateTime[i] * powerStateCurrent[i];
+  }
+  root["PowerPolicy"] = settings.powerPolicy;
+  root["PowerState"] = powerStateNames[powerState];
+  root["PowerEstCurrent"] = powerStateCurrent[powerState];
+  if (total > 0) {
+    root["PowerAvgCurrent"] = (uint32_t)(charge / total);
+    root["DutyActive"] = (uint32_t)((uint64_t)powerStateTime[PowerStateActive] * 100 / total);
+    root["DutyModemSleep"] = (uint32_t)((uint64_t)powerStateTime[PowerStateModemSleep] * 100 / total);
+    root["DutyLightSleep"] = (uint32_t)((uint64_t)powerStateTime[PowerStateLightSleep] * 100 / total);
+  }
+}
+
+// Wake keeping
+typedef enum {
+  WakeStepIdle = 0,
+  WakeStepSafe = 1,
+  WakeStepBrcLow = 2,
+  WakeStepBrcReleased = 3,
+} WakeStep;
+
+uint8_t wakeStep = WakeStepIdle;
+unsigned long wakeStepTime = 0;
+uint32_t wakeInterval = WAKE_INITIAL_INTERVAL_MS; // Set from settings in setup()
+uint8_t wakeCyclesAwake = 0;
+unsigned long lastWakePulseTime = 0;
+unsigned long lastFrameTime = 0;
+unsigned long commandHoldoffUntil = 0;
+bool roombaAsleep = false;
+
+// Measured to the last frame from the awake Roomba, not to when it is
+// noticed, which for a stopped stream is up to WAKE_FRAME_GAP_MS later.
+// roombaState still holds that frame when the OI mode changes to off.
+void noteRoombaAsleep(const char *reason) {
+  if (roombaAsleep) {
+    return;
+  }
+  roombaAsleep = true;
+  wakeCyclesAwake = 0;
+  // The Roomba stayed awake for this long after the last pulse, so pulse a bit earlier next time
+  long lastAwake = (unsigned long)roombaState.timestamp - lastWakePulseTime;
+  uint32_t awake = lastAwake > 0 ? lastAwake : 0;
+  if (awake * 3 / 4 < wakeInterval) {
+    wakeInterval = max(awake * 3 / 4, settings.wakeMinInterval);
+  }
+  DLOG("Roomba fell asleep (%s) after %ums, wake interval now %ums\n", reason, awake, wakeInterval);
+}
+
+// Called for every accepted stream frame
+void onWakeFrame(unsigned long now, uint8_t previousMode, uint8_t mode) {
+  if (roombaAsleep) {
+    DLOG("Roomba is awake again\n");
+    roombaAsleep = false;
+  }
+  if (previousMode != Roomba::ModeOff && mode == Roomba::ModeOff) {
+    noteRoombaAsleep("OI mode changed to off");
+  }
+  lastFrameTime = now;
+}
+
+void cancelWakeSequence() {
+  if (wakeStep == WakeStepIdle) {
+    return;
+  }
+  DLOG("Cancel wake sequence\n");
+  pinMode(BRC_PIN,INPUT);
+  wakeStep = WakeStepIdle;
+}
+
+// Non-blocking equivalent of wakeOffDock() followed by wakeup()
+void stepWakeSequence(unsigned long now) {
+  switch (wakeStep) {
+    case WakeStepIdle:
+      DLOG("Wake sequence: safe mode\n");
+      Serial.write(131); // Safe mode
+      wakeStep = WakeStepSafe;
+      wakeStepTime = now;
+      break;
+    case WakeStepSafe:
+      if (now - wakeStepTime < 300) {
+        return;
+      }
+      DLOG("Wake sequence: passive mode, BRC low\n");
+      Serial.write(130); // Passive mode
+      pinMode(BRC_PIN,OUTPUT);
+      digitalWrite(BRC_PIN,LOW);
+      wakeStep = WakeStepBrcLow;
+      wakeStepTime = now;
+      break;
+    case WakeStepBrcLow:
+      if (now - wakeStepTime < 1000) {
+        return;
+      }
+      pinMode(BRC_PIN,INPUT);
+      wakeStep = WakeStepBrcReleased;
+      wakeStepTime = now;
+      break;
+    case WakeStepBrcReleased:
+      if (now - wakeStepTime < 1000) {
+        return;
+      }
+      if (roombaState.OIMode == Roomba::ModeOff || roombaState.OIMode == Roomba::ModePassive) {
+        Serial.write(128); // Start
+      }
+      wakeStep = WakeStepIdle;
+      lastWakePulseTime = now;
+      // Slowly probe for a longer interval while the Roomba keeps staying awake
+      if (!roombaAsleep && ++wakeCyclesAwake >= 10) {
+        wakeCyclesAwake = 0;
+        wakeInterval = min(wakeInterval + wakeInterval / 16, settings.wakeMaxInterval);
+      }
+      DLOG("Wake sequence done, next in %ums\n", wakeInterval);
+      break;
+  }
+}
+
+void updateWakeKeeper(unsigned long now) {
+  if (wakeStep != WakeStepIdle) {
+    stepWakeSequence(now);
+    return;
+  }
+  if (!streamPaused && lastFrameTime != 0 && now - lastFrameTime > WAKE_FRAME_GAP_MS
+      && now - streamChangeTime > WAKE_FRAME_GAP_MS) {
+    noteRoombaAsleep("stream stopped");
+  }
+  if (roombaState.cleaning || roombaState.returning || roombaState.docked || stop_wakeup) {
+    return;
+  }
+  if ((long)(commandHoldoffUntil - now) > 0) {
+    return;
+  }
+  uint32_t due = roombaAsleep ? settings.wakeMinInterval : wakeInterval;
+  if (now - lastWakePulseTime > due) {
+    stepWakeSequence(now);
+  }
+}
+
 void wakeup() {
   DLOG("Wakeup Roomba\n");
+  cancelWakeSequence();
   pinMode(BRC_PIN,OUTPUT);
   digitalWrite(BRC_PIN,LOW);
   delay(1000);
@@ -110,6 +523,7 @@ void wakeup() {
   else {
     DLOG("OIMode is neither 0 nor 1; do nothing\n");
   }
+  lastWakePulseTime = millis();
 }
 
 void wakeOnDock() {
@@ -147,6 +561,95 @@ void setOIModeFull() {
   Serial.write(132); // Full mode
 }
 
+// Songs
+// Melodies are uploaded to the song slots once the OI is up and again after the
+// Roomba slept or was reset, so playing one is a single Play command.
+typedef struct {
+  const char *name;
+  const uint8_t *notes; // note/duration pairs, duration in 1/64 s
+  uint8_t length;       // in bytes
+} Melody;
+
+typedef enum {
+  MelodyLocate = 0,
+  MelodyAlert = 1,
+  MelodyLowBattery = 2,
+  MelodyDone = 3,
+  MelodyCount
+} MelodyID;
+
+const uint8_t locateNotes[] = {57, 8, 75, 8, 73, 16};
+const uint8_t alertNotes[] = {84, 8, 79, 8, 84, 8, 79, 8};
+const uint8_t lowBatteryNotes[] = {72, 16, 67, 16, 60, 32};
+const uint8_t doneNotes[] = {60, 8, 64, 8, 67, 8, 72, 16};
+
+const Melody melodies[MelodyCount] = {
+  {"locate", locateNotes, sizeof(locateNotes)},
+  {"alert", alertNotes, sizeof(alertNotes)},
+  {"lowbattery", lowBatteryNotes, sizeof(lowBatteryNotes)},
+  {"done", doneNotes, sizeof(doneNotes)},
+};
+
+static_assert(MelodyCount <= SONG_SLOT_COUNT, "More melodies than song slots");
+
+// Bit n is set while melody n is defined in song slot n
+uint16_t songSlotsValid = 0;
+// Time to put the OI back into passive mode after a song, 0 if none is playing
+unsigned long songEndTime = 0;
+
+void uploadMelody(uint8_t id) {
+  roomba.song(id, melodies[id].notes, melodies[id].length);
+  songSlotsValid |= 1 << id;
+}
+
+// Plays a melody, uploading it first if the slot isn't valid
+bool playMelody(uint8_t id) {
+  if (id >= MelodyCount) {
+    return false;
+  }
+  if (!(songSlotsValid & (1 << id))) {
+    DLOG("Song slot %d not valid, uploading %s\n", id, melodies[id].name);
+    uploadMelody(id);
+  }
+  uint16_t duration = 0;
+  for (int i = 1; i < melodies[id].length; i += 2) {
+    duration += melodies[id].notes[i];
+  }
+  Serial.write(131); // Songs only play in safe or full mode
+  roomba.playSong(id);
+  songEndTime = max(millis() + duration * 1000 / 64 + 250, 1UL);
+  return true;
+}
+
+bool playMelody(const char *name) {
+  for (int i = 0; i < MelodyCount; i++) {
+    if (strcmp(melodies[i].name, name) == 0) {
+      return playMelody(i);
+    }
+  }
+  return false;
+}
+
+void updateSongs(unsigned long now) {
+  if (songEndTime != 0 && (long)(now - songEndTime) >= 0) {
+    Serial.write(128); // Back to passive mode
+    songEndTime = 0;
+  }
+  // Song definitions don't survive the OI shutting down
+  if (roombaAsleep || roombaState.OIMode == Roomba::ModeOff || lastFrameTime == 0) {
+    songSlotsValid = 0;
+    return;
+  }
+  // Upload one melody per loop so no iteration writes them all
+  for (int i = 0; i < MelodyCount; i++) {
+    if (!(songSlotsValid & (1 << i))) {
+      DLOG("Uploading melody %s to song slot %d\n", melodies[i].name, i);
+      uploadMelody(i);
+      break;
+    }
+  }
+}
+
 void sendPacket(char *packetPayload) {
   DLOG("Prepare to send packet %s\n", packetPayload);
   char* command = strtok(packetPayload, " ");
@@ -158,7 +661,14 @@ void sendPacket(char *packetPayload) {
 }
 
 bool performCommand(const char *cmdchar) {
-  wakeup();
+  // Only pay for the blocking BRC pulse if the Roomba isn't already streaming
+  cancelWakeSequence();
+  if (roombaAsleep || streamPaused || lastFrameTime == 0) {
+    wakeup();
+  }
+  commandHoldoffUntil = millis() + WAKE_COMMAND_HOLDOFF_MS;
+  // Any command changes the OI mode itself, don't switch back to passive after a song
+  songEndTime = 0;
 
   // Char* string comparisons dont always work
   String cmd(cmdchar);
@@ -214,13 +724,13 @@ bool performCommand(const char *cmdchar) {
       DLOG("Not locating - currently cleaning/returning\n");
     } else {
       DLOG("Locating\n");
-      // Set Song Number 1 and play it directly - still a little buggy
-      char commandArray[39];
-      String s = "140 1 3 57 8 75 8 73 16 0 131 0 141 1";
-      s.toCharArray(commandArray, 39);
-      sendPacket(commandArray);
-      delay(750);
-      Serial.write(128); // Start command
+      playMelody(MelodyLocate);
+    }
+  } else if (cmd.substring(0,5) == "play ") {
+    if (roombaState.cleaning || roombaState.returning) {
+      DLOG("Not playing - currently cleaning/returning\n");
+    } else if (!playMelody(cmd.substring(5).c_str())) {
+      DLOG("Unknown melody %s\n", cmd.substring(5).c_str());
     }
   } else if (cmd == "return_to_base") {
     DLOG("Returning to Base\n");
@@ -237,6 +747,21 @@ bool performCommand(const char *cmdchar) {
   } else if (cmd == "sleep"){
     DLOG("Received sleep command, will sleep 10 seconds\n");
     //ESP.deepSleep(10000000); - disabled due to not connected GPIO16 to RST
+  } else if (cmd == "dump_log") {
+    DLOG("Sending binary log through MQTT\n");
+    uint8_t chunk[384];
+    static_assert(sizeof(chunk) >= BINLOG_MAX_RECORD, "Binlog records don't fit the MQTT chunk");
+    size_t length;
+    while ((length = binlogRead(chunk, sizeof(chunk))) > 0) {
+      mqttPublish(debugTopic, chunk, length);
+    }
+  } else if (cmd == "capture_start" || cmd.substring(0,14) == "capture_start ") {
+    uint32_t seconds = cmd.length() > 14 ? cmd.substring(14).toInt() : CAPTURE_DEFAULT_MS / 1000;
+    DLOG("Capturing serial data for %ds\n", seconds);
+    captureStart(seconds * 1000);
+  } else if (cmd == "capture_stop") {
+    DLOG("Stopping serial capture\n");
+    captureStop();
   } else if (cmd == "reboot"){
     DLOG("Reboot ESP...");
     ESP.restart();
@@ -245,33 +770,581 @@ bool performCommand(const char *cmdchar) {
   }
   return true;
 }
+// Publishes the current settings, and the reason if an update was rejected
+void publishSettings(const char *error) {
+  if (!mqttClient.connected()) {
+    return;
+  }
+  StaticJsonBuffer<600> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  if (error) {
+    root["error"] = error;
+  }
+  root["version"] = settings.version;
+  root["statusInterval"] = settings.statusInterval;
+  root["infoInterval"] = settings.infoInterval;
+  root["reconnectInterval"] = settings.reconnectInterval;
+  root["staleThreshold"] = settings.staleThreshold;
+  root["wakeInitialInterval"] = settings.wakeInitialInterval;
+  root["wakeMinInterval"] = settings.wakeMinInterval;
+  root["wakeMaxInterval"] = settings.wakeMaxInterval;
+  root["powerPolicy"] = settings.powerPolicy;
+  root["stallThreshold"] = settings.stallThreshold;
+  JsonArray& sensorList = root.createNestedArray("sensors");
+  for (int i = 0; i < settings.sensorCount; i++) {
+    sensorList.add(settings.sensors[i]);
+  }
+  String jsonStr;
+  root.printTo(jsonStr);
+  mqttPublish(configStateTopic, jsonStr.c_str(), true);
+}
+
+// Applies the settings live after they changed from previous
+void applySettings(const Settings &previous) {
+  watchdogSetThreshold(settings.stallThreshold);
+  if (previous.powerPolicy != settings.powerPolicy) {
+    resetPowerStats(millis());
+  }
+  wakeInterval = constrain(wakeInterval, settings.wakeMinInterval, settings.wakeMaxInterval);
+  if (previous.sensorCount != settings.sensorCount
+      || memcmp(previous.sensors, settings.sensors, settings.sensorCount) != 0) {
+    DLOG("Sensor list changed, requesting new stream\n");
+    roomba.stream(settings.sensors, settings.sensorCount);
+  }
+  publishSettings(NULL);
+}
+
+// Reads an optional numeric setting, returns false if it is out of range
+bool readSetting(JsonObject &root, const char *key, long minValue, long maxValue, uint32_t *value) {
+  if (!root.containsKey(key)) {
+    return true;
+  }
+  long v = root[key].as<long>();
+  if (v < minValue || v > maxValue) {
+    return false;
+  }
+  *value = v;
+  return true;
+}
+
+// Validates and applies a JSON settings update, e.g. {"statusInterval":5000,"sensors":[21,22,24]}
+void updateSettings(const char *json) {
+  StaticJsonBuffer<600> jsonBuffer;
+  JsonObject& root = jsonBuffer.parseObject(json);
+  if (!root.success()) {
+    publishSettings("invalid JSON");
+    return;
+  }
+
+  Settings updated = settings;
+  uint32_t powerPolicy = updated.powerPolicy;
+  if (!readSetting(root, "statusInterval", 1000, 3600000, &updated.statusInterval)
+      || !readSetting(root, "infoInterval", 5000, 86400000, &updated.infoInterval)
+      || !readSetting(root, "reconnectInterval", 5000, 3600000, &updated.reconnectInterval)
+      || !readSetting(root, "staleThreshold", 2000, 3600000, &updated.staleThreshold)
+      || !readSetting(root, "wakeInitialInterval", 5000, 3600000, &updated.wakeInitialInterval)
+      || !readSetting(root, "wakeMinInterval", 5000, 3600000, &updated.wakeMinInterval)
+      || !readSetting(root, "wakeMaxInterval", 5000, 3600000, &updated.wakeMaxInterval)
+      || !readSetting(root, "stallThreshold", 100, 60000, &updated.stallThreshold)
+      || !readSetting(root, "powerPolicy", PowerPolicyAlwaysOn, PowerPolicyLightSleep, &powerPolicy)) {
+    publishSettings("value out of range");
+    return;
+  }
+  updated.powerPolicy = powerPolicy;
+  if (updated.wakeMinInterval > updated.wakeInitialInterval || updated.wakeInitialInterval > updated.wakeMaxInterval) {
+    publishSettings("wake intervals must be min <= initial <= max");
+    return;
+  }
+
+  if (root.containsKey("sensors")) {
+    JsonArray& sensorList = root["sensors"];
+    if (!sensorList.success() || sensorList.size() == 0 || sensorList.size() > SETTINGS_MAX_SENSORS) {
+      publishSettings("sensors must be a list of 1 to 24 packet IDs");
+      return;
+    }
+    bool hasTemperature = false;
+    int packetSize = 0;
+    for (size_t i = 0; i < sensorList.size(); i++) {
+      int packetID = sensorList[i].as<int>();
+      uint8_t size = packetID >= 0 && packetID <= 255 ? sensorPacketSize(packetID) : 0;
+      if (size == 0) {
+        publishSettings("unsupported sensor packet ID");
+        return;
+      }
+      hasTemperature |= packetID == Roomba::SensorBatteryTemperature;
+      packetSize += size + 1;
+      updated.sensors[i] = packetID;
+    }
+    // Frames without a temperature are rejected by handleSensorFrame()
+    if (!hasTemperature) {
+      publishSettings("sensors must include the battery temperature (24)");
+      return;
+    }
+    if (packetSize > (int)sizeof(roombaPacket)) {
+      publishSettings("too many sensors for one stream packet");
+      return;
+    }
+    updated.sensorCount = sensorList.size();
+  }
+
+  Settings previous = settings;
+  settings = updated;
+  saveSettings();
+  DLOG("Settings updated\n");
+  applySettings(previous);
+}
+
+// Command tracking
+// Commands sent as {"id":"...","command":"clean"} get ack/complete/failed responses
+// with timings: received -> written to serial -> effect observed in the stream.
+typedef enum {
+  ExpectNone = 0,      // Complete once written
+  ExpectMotorsOn = 1,  // Cleaning current draw
+  ExpectMotorsOff = 2,
+  ExpectDocked = 3,
+} CommandExpectation;
+
+typedef struct {
+  char id[32];
+  char command[24];
+  uint8_t expect;
+  unsigned long receivedTime;
+  uint32_t writtenMicros; // received -> written
+} PendingCommand;
+
+PendingCommand pendingCommands[COMMAND_PENDING_MAX];
+uint8_t pendingCommandCount = 0;
+
+// Histogram of received -> observed latency, bucket n holds latencies below 2^(n+4) ms
+#define COMMAND_LATENCY_BUCKETS 12
+uint32_t commandLatencyHistogram[COMMAND_LATENCY_BUCKETS];
+
+void recordCommandLatency(uint32_t ms) {
+  uint8_t bucket = 0;
+  while (bucket < COMMAND_LATENCY_BUCKETS - 1 && ms >= (16UL << bucket)) {
+    bucket++;
+  }
+  commandLatencyHistogram[bucket]++;
+}
+
+// Upper bound of the bucket holding the given percentile, in ms
+uint32_t commandLatencyPercentile(uint8_t percentile) {
+  uint32_t total = 0;
+  for (int i = 0; i < COMMAND_LATENCY_BUCKETS; i++) {
+    total += commandLatencyHistogram[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  uint32_t rank = (total * percentile + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < COMMAND_LATENCY_BUCKETS; i++) {
+    seen += commandLatencyHistogram[i];
+    if (seen >= rank) {
+      return 16UL << i;
+    }
+  }
+  return 16UL << (COMMAND_LATENCY_BUCKETS - 1);
+}
+
+void publishCommandResponse(const char *id, const char *command, const char *status,
+                            int32_t writtenMicros, int32_t observedMs, const char *error) {
+  StaticJsonBuffer<300> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  root["id"] = id;
+  root["command"] = command;
+  root["status"] = status;
+  if (writtenMicros >= 0) {
+    root["writtenUs"] = writtenMicros;
+  }
+  if (observedMs >= 0) {
+    root["observedMs"] = observedMs;
+  }
+  if (error) {
+    root["error"] = error;
+  }
+  String jsonStr;
+  root.printTo(jsonStr);
+  mqttPublish(commandResponseTopic, jsonStr.c_str());
+}
+
+uint8_t commandExpectation(const char *cmd) {
+  if (strcmp(cmd, "clean") == 0 || strcmp(cmd, "clean_spot") == 0) {
+    return ExpectMotorsOn;
+  } else if (strcmp(cmd, "stop") == 0 || strcmp(cmd, "turn_off") == 0) {
+    return ExpectMotorsOff;
+  } else if (strcmp(cmd, "toggle") == 0 || strcmp(cmd, "start_pause") == 0) {
+    return roombaState.cleaning ? ExpectMotorsOff : ExpectMotorsOn;
+  } else if (strcmp(cmd, "return_to_base") == 0) {
+    return ExpectDocked;
+  }
+  return ExpectNone;
+}
+
+// now is the time the outcome was seen, for an observed change that of the frame
+void completeCommand(uint8_t index, unsigned long now, const char *status, const char *error) {
+  PendingCommand &pending = pendingCommands[index];
+  uint32_t observed = now - pending.receivedTime;
+  if (error) {
+    metricsCount(MetricCommandsFailed);
+  } else {
+    recordCommandLatency(observed);
+  }
+  publishCommandResponse(pending.id, pending.command, status, pending.writtenMicros, observed, error);
+  pendingCommands[index] = pendingCommands[--pendingCommandCount];
+}
+
+// Called for every accepted stream frame, with its ingest time. A backlog can
+// still hold frames from before a command came in, they don't count for it.
+void observeCommands(unsigned long frameTime) {
+  for (int i = pendingCommandCount - 1; i >= 0; i--) {
+    if ((long)(frameTime - pendingCommands[i].receivedTime) < 0) {
+      continue;
+    }
+    bool observed = false;
+    switch (pendingCommands[i].expect) {
+      case ExpectMotorsOn:
+        observed = roombaState.current < -400;
+        break;
+      case ExpectMotorsOff:
+        observed = roombaState.current >= -400;
+        break;
+      case ExpectDocked:
+        observed = derived.onDock;
+        break;
+    }
+    if (observed) {
+      completeCommand(i, frameTime, "complete", NULL);
+    }
+  }
+}
+
+void expireCommands(unsigned long now) {
+  for (int i = pendingCommandCount - 1; i >= 0; i--) {
+    uint32_t timeout = pendingCommands[i].expect == ExpectDocked ? COMMAND_DOCK_TIMEOUT_MS : COMMAND_TIMEOUT_MS;
+    if (now - pendingCommands[i].receivedTime > timeout) {
+      completeCommand(i, now, "failed", "state change not observed");
+    }
+  }
+}
+
+// receivedTime and receivedMicros are taken when the command came in, before it was queued
+void performTrackedCommand(const char *json, unsigned long receivedTime, uint32_t receivedMicros) {
+  StaticJsonBuffer<200> jsonBuffer;
+  JsonObject& root = jsonBuffer.parseObject(json);
+  const char *id = root.success() ? root["id"].as<const char *>() : NULL;
+  const char *cmd = root.success() ? root["command"].as<const char *>() : NULL;
+  if (!id || !cmd) {
+    DLOG("Invalid command envelope %s\n", json);
+    metricsCount(MetricCommandsFailed);
+    publishCommandResponse(id ? id : "", "", "failed", -1, -1, "invalid envelope");
+    return;
+  }
+  metricsCount(MetricCommands);
+  publishCommandResponse(id, cmd, "ack", -1, -1, NULL);
+
+  uint8_t expect = commandExpectation(cmd);
+  if (!performCommand(cmd)) {
+    DLOG("Unknown command %s\n", cmd);
+    metricsCount(MetricCommandsFailed);
+    publishCommandResponse(id, cmd, "failed", -1, -1, "unknown command");
+    return;
+  }
+  uint32_t writtenMicros = micros() - receivedMicros;
+
+  if (expect == ExpectNone) {
+    recordCommandLatency(millis() - receivedTime);
+    publishCommandResponse(id, cmd, "complete", writtenMicros, millis() - receivedTime, NULL);
+    return;
+  }
+  if (pendingCommandCount == COMMAND_PENDING_MAX) {
+    // Oldest command gives way. Completed entries are swap-removed, so the
+    // array isn't in order.
+    unsigned long now = millis();
+    uint8_t oldest = 0;
+    for (uint8_t i = 1; i < pendingCommandCount; i++) {
+      if (now - pendingCommands[i].receivedTime > now - pendingCommands[oldest].receivedTime) {
+        oldest = i;
+      }
+    }
+    completeCommand(oldest, now, "failed", "superseded");
+  }
+  PendingCommand &pending = pendingCommands[pendingCommandCount++];
+  strncpy(pending.id, id, sizeof(pending.id) - 1);
+  pending.id[sizeof(pending.id) - 1] = 0;
+  strncpy(pending.command, cmd, sizeof(pending.command) - 1);
+  pending.command[sizeof(pending.command) - 1] = 0;
+  pending.expect = expect;
+  pending.receivedTime = receivedTime;
+  pending.writtenMicros = writtenMicros;
+}
+
 //MQTT callback for receiving submitted commands & messages
+// Commands are queued by the MQTT callback and run one per loop in the order
+// they arrived. After a reconnect the broker delivers all commands published
+// in the meantime in one burst.
+typedef struct {
+  char command[COMMAND_MAX_LENGTH + 1];
+  unsigned long receivedTime;
+  uint32_t receivedMicros;
+} QueuedCommand;
+
+QueuedCommand commandQueue[COMMAND_QUEUE_LENGTH];
+uint8_t commandQueueHead = 0;
+uint8_t commandQueueCount = 0;
+// Packet IDs of the last QoS 1 commands. The broker redelivers a command with
+// the same ID and the DUP flag if the connection dropped before it was
+// acknowledged. IDs are reused once acknowledged, so without the flag a
+// known ID is a new command.
+uint16_t recentCommandIds[COMMAND_RECENT_IDS];
+uint8_t recentCommandIndex = 0;
+
+// Packet ID of the message passed to mqttCallback, 0 for QoS 0
+uint16_t inboundPacketId(const char *topic, const byte *payload) {
+#if MQTT5
+  (void)topic;
+  (void)payload;
+  return mqttClient.inboundPacketId();
+#else
+  // PubSubClient doesn't pass the ID on. It terminates the topic in place in its
+  // buffer, for QoS 1 the two bytes of the ID follow between it and the payload.
+  if (payload - (const byte *)topic == (ptrdiff_t)strlen(topic) + 3) {
+    return payload[-2] << 8 | payload[-1];
+  }
+  return 0;
+#endif
+}
+
+// True if the message passed to mqttCallback has the DUP flag set
+bool inboundDuplicate(const char *topic, const byte *payload) {
+#if MQTT5
+  (void)topic;
+  (void)payload;
+  return mqttClient.inboundDuplicate();
+#else
+  // The fixed header is in front of the topic's length high byte and the
+  // remaining length, whose bytes all but the last have bit 7 set
+  const byte *p = (const byte *)topic - 2;
+  int lengthBytes = 1;
+  while (lengthBytes < 4 && (p[-1] & 0x80)) {
+    p--;
+    lengthBytes++;
+  }
+  uint8_t header = p[-1];
+  return (header & 0xF0) == 0x30 && (header & 0x08);
+#endif
+}
+
+bool isDuplicateCommand(uint16_t packetId, bool dup) {
+  if (packetId == 0) {
+    return false;
+  }
+  for (int i = 0; i < COMMAND_RECENT_IDS; i++) {
+    if (recentCommandIds[i] == packetId) {
+      return dup;
+    }
+  }
+  recentCommandIds[recentCommandIndex] = packetId;
+  recentCommandIndex = (recentCommandIndex + 1) % COMMAND_RECENT_IDS;
+  return false;
+}
+
+void queueCommand(const byte *payload, unsigned int length, unsigned long receivedTime, uint32_t receivedMicros) {
+  if (commandQueueCount == COMMAND_QUEUE_LENGTH || length > COMMAND_MAX_LENGTH) {
+    DLOG("Command dropped, %s\n", length > COMMAND_MAX_LENGTH ? "too long" : "queue full");
+    metricsCount(MetricCommandsDropped);
+    return;
+  }
+  QueuedCommand &queued = commandQueue[(commandQueueHead + commandQueueCount) % COMMAND_QUEUE_LENGTH];
+  memcpy(queued.command, payload, length);
+  queued.command[length] = 0;
+  queued.receivedTime = receivedTime;
+  queued.receivedMicros = receivedMicros;
+  commandQueueCount++;
+}
+
+void runQueuedCommand() {
+  if (commandQueueCount == 0) {
+    return;
+  }
+  QueuedCommand &queued = commandQueue[commandQueueHead];
+  char *cmd = queued.command;
+  if (cmd[0] == '{') {
+    performTrackedCommand(cmd, queued.receivedTime, queued.receivedMicros);
+  } else if(!performCommand(cmd)) {
+    DLOG("Unknown command %s\n", cmd);
+  }
+  commandQueueHead = (commandQueueHead + 1) % COMMAND_QUEUE_LENGTH;
+  commandQueueCount--;
+}
+
 void mqttCallback(char *topic, byte *payload, unsigned int length) {
   DLOG("Received mqtt callback for topic %s with payload %s\n", topic, payload);
   if (strcmp(commandTopic, topic) == 0) {
-    // turn payload into a null terminated string
-    char *cmd = (char *)malloc(length + 1);
-    memcpy(cmd, payload, length);
-    cmd[length] = 0;
+    unsigned long receivedTime = millis();
+    uint32_t receivedMicros = micros();
+    uint16_t packetId = inboundPacketId(topic, payload);
+    if (isDuplicateCommand(packetId, inboundDuplicate(topic, payload))) {
+      DLOG("Duplicate command %u dropped\n", packetId);
+      metricsCount(MetricCommandDuplicates);
+      return;
+    }
+    queueCommand(payload, length, receivedTime, receivedMicros);
+  } else if (strcmp(configTopic, topic) == 0) {
+    char *json = (char *)malloc(length + 1);
+    memcpy(json, payload, length);
+    json[length] = 0;
+    updateSettings(json);
+    free(json);
+  }
+}
 
-    if(!performCommand(cmd)) {
-      DLOG("Unknown command %s\n", cmd);
+void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
+  if (num >= WEBSOCKETS_SERVER_CLIENT_MAX) {
+    return;
+  }
+  switch (type) {
+    case WStype_CONNECTED:
+      if (webSocketClientCount >= WEBSOCKET_MAX_CLIENTS) {
+        DLOG("WebSocket client %d rejected, too many clients\n", num);
+        webSocket.disconnect(num);
+        break;
+      }
+      DLOG("WebSocket client %d connected\n", num);
+      webSocketConnected[num] = true;
+      webSocketInterval[num] = WEBSOCKET_DEFAULT_INTERVAL_MS;
+      webSocketLastSend[num] = 0;
+      webSocketClientCount++;
+      break;
+    case WStype_DISCONNECTED:
+      if (webSocketConnected[num]) {
+        DLOG("WebSocket client %d disconnected\n", num);
+        webSocketConnected[num] = false;
+        webSocketClientCount--;
+      }
+      break;
+    case WStype_TEXT:
+      if (webSocketConnected[num] && length > 9 && strncmp((const char *)payload, "interval=", 9) == 0) {
+        int interval = atoi((const char *)payload + 9);
+        webSocketInterval[num] = constrain(interval, WEBSOCKET_MIN_INTERVAL_MS, 60000);
+        DLOG("WebSocket client %d interval %dms\n", num, webSocketInterval[num]);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void broadcastLiveFrame(unsigned long now) {
+  if (webSocketClientCount == 0) {
+    return;
+  }
+  LiveFrame frame;
+  frame.version = 1;
+  frame.timestamp = roombaState.timestamp;
+  frame.distance = roombaState.distance;
+  frame.chargingState = roombaState.chargingState;
+  frame.voltage = roombaState.voltage;
+  frame.current = roombaState.current;
+  frame.charge = roombaState.charge;
+  frame.capacity = roombaState.capacity;
+  frame.temp = roombaState.temp;
+  frame.chargingSourcesAvailable = roombaState.chargingSourcesAvailable;
+  frame.OIMode = roombaState.OIMode;
+  frame.leftencodercounts = roombaState.leftencodercounts;
+  frame.rightencodercounts = roombaState.rightencodercounts;
+  frame.stasis = roombaState.stasis;
+  frame.flags = roombaState.cleaning | roombaState.docked << 1 | roombaState.returning << 2;
+  for (uint8_t i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
+    if (webSocketConnected[i] && now - webSocketLastSend[i] >= webSocketInterval[i]) {
+      webSocketLastSend[i] = now;
+      webSocket.sendBIN(i, (const uint8_t *)&frame, sizeof(frame));
     }
-    free(cmd);
   }
 }
 
-float readADC(int samples) {
-  // Basic code to read from the ADC
-  int adc = 0;
-  for (int i = 0; i < samples; i++) {
-    delay(1);
-    adc += analogRead(A0);
+// Background ADC sampling
+// Voltage divider in 24.8 fixed point, so no soft-float is needed per sample
+#define ADC_DIVIDER_FIXED ((uint32_t)(ADC_VOLTAGE_DIVIDER * 256))
+
+uint16_t adcSamples[3];
+uint8_t adcSampleCount = 0;
+// IIR filtered battery voltage in mV, 28.4 fixed point
+uint32_t adcFiltered = 0;
+unsigned long lastAdcSampleTime = 0;
+
+uint16_t median3(uint16_t a, uint16_t b, uint16_t c) {
+  if (a > b) {
+    uint16_t t = a; a = b; b = t;
+  }
+  return c < a ? a : (c > b ? b : c);
+}
+
+// Takes at most one ADC sample per call, so it never blocks the loop
+void sampleADC(unsigned long now) {
+  if (now - lastAdcSampleTime < ADC_SAMPLE_INTERVAL_MS) {
+    return;
+  }
+  lastAdcSampleTime = now;
+  uint16_t mV = (analogRead(A0) * ADC_DIVIDER_FIXED) >> 8;
+  adcSamples[adcSampleCount % 3] = mV;
+  if (adcSampleCount < 3) {
+    // Prime the filter with the first samples
+    adcSampleCount++;
+    adcFiltered = (uint32_t)mV << 4;
+    return;
+  }
+  adcSampleCount = 3 + (adcSampleCount + 1) % 3;
+  // Median of the last three samples rejects spikes, then IIR with alpha 1/8
+  uint32_t median = (uint32_t)median3(adcSamples[0], adcSamples[1], adcSamples[2]) << 4;
+  adcFiltered = adcFiltered - (adcFiltered >> 3) + (median >> 3);
+}
+
+// Filtered battery voltage from the ADC in mV, 0 if not available
+uint16_t adcVoltage() {
+  uint16_t mV = adcFiltered >> 4;
+  return mV >= ADC_MIN_VALID_MV ? mV : 0;
+}
+
+// Battery voltage from the stream, or from the ADC if the stream is dead
+uint16_t batteryVoltage(unsigned long now) {
+#ifdef ENABLE_ADC_SLEEP
+  if (lastFrameTime == 0 || now - lastFrameTime > settings.staleThreshold) {
+    return adcVoltage();
+  }
+#endif
+  return roombaState.voltage;
+}
+
+// Buffer for on-demand sensor queries issued from telnet
+uint8_t queryPacket[52];
+
+// Set by onQueryComplete(), which runs in ingestSensors(), and reported from the loop
+bool queryDone = false;
+bool querySucceeded;
+uint8_t queryLength;
+
+void onQueryComplete(bool success, uint8_t *data, uint8_t length) {
+  (void)data;
+  querySucceeded = success;
+  queryLength = length;
+  queryDone = true;
+}
+
+void reportQuery() {
+  if (!queryDone) {
+    return;
+  }
+  queryDone = false;
+  if (!querySucceeded) {
+    DLOG("Sensor query timed out after %d bytes\n", queryLength);
+    return;
+  }
+  DLOG("Sensor query returned %d bytes: ", queryLength);
+  for (int i = 0; i < queryLength; i++) {
+    DLOG("%d ", queryPacket[i]);
   }
-  adc = adc / samples;
-  float mV = adc * ADC_VOLTAGE_DIVIDER;
-  VLOG("ADC for %d is %.1fmV with %d samples\n", adc, mV, samples);
-  return mV;
+  DLOG("\n");
 }
 
 void debugCallback() {
@@ -285,8 +1358,9 @@ void debugCallback() {
   } else if (cmd == "rreset") {
     DLOG("Resetting Roomba\n");
     roomba.reset();
+    songSlotsValid = 0;
   } else if (cmd == "mqtthello") {
-    mqttClient.publish("vacuum/hello", "hello there");
+    mqttPublish("vacuum/hello", "hello there");
   } else if (cmd == "version") {
     const char compile_date[] = __DATE__ " " __TIME__;
     DLOG("Compiled on: %s\n", compile_date);
@@ -335,8 +1409,7 @@ void debugCallback() {
     DLOG("Disable Soft AP\n");
     WiFi.softAPdisconnect(true);
   } else if (cmd == "readadc") {
-    float adc = readADC(10);
-    DLOG("ADC voltage is %.1fmV\n", adc);
+    DLOG("ADC voltage is %dmV (raw filtered %dmV)\n", adcVoltage(), adcFiltered >> 4);
   } else if (cmd == "streamresume") {
     DLOG("Resume streaming\n");
     roomba.streamCommand(Roomba::StreamCommandResume);
@@ -345,10 +1418,45 @@ void debugCallback() {
     roomba.streamCommand(Roomba::StreamCommandPause);
   } else if (cmd == "stream") {
     DLOG("Requesting stream\n");
-    roomba.stream(sensors, sizeof(sensors));
+    roomba.stream(settings.sensors, settings.sensorCount);
   } else if (cmd == "streamreset") {
     DLOG("Resetting stream\n");
     roomba.stream({}, 0);
+  } else if (cmd.substring(0,5) == "query") {
+    // query <packetID> <length>, answered asynchronously between stream packets
+    int packetID = atoi(cmd.substring(6).c_str());
+    int length = atoi(cmd.substring(cmd.indexOf(' ', 6) + 1).c_str());
+    if (length <= 0 || length > (int)sizeof(queryPacket)) {
+      DLOG("Invalid query length %d\n", length);
+    } else if (roomba.getSensorsAsync(packetID, queryPacket, length, onQueryComplete)) {
+      DLOG("Querying sensor packet %d (%d bytes)\n", packetID, length);
+    } else {
+      DLOG("Sensor query already pending\n");
+    }
+  } else if (cmd.substring(0,11) == "powerpolicy") {
+    Settings previous = settings;
+    settings.powerPolicy = constrain(atoi(cmd.substring(11).c_str()), PowerPolicyAlwaysOn, PowerPolicyLightSleep);
+    saveSettings();
+    applySettings(previous);
+    DLOG("Power policy set to %d\n", settings.powerPolicy);
+  } else if (cmd == "settingsreset") {
+    DLOG("Resetting settings to defaults\n");
+    Settings previous = settings;
+    resetSettings();
+    saveSettings();
+    applySettings(previous);
+  } else if (cmd == "binlog") {
+    // Hex dump for tools/binlog_decode.py
+    DLOG("BL-DROPPED %u\n", binlogDropped());
+    uint8_t chunk[BINLOG_MAX_RECORD];
+    char hex[sizeof(chunk) * 2 + 1];
+    size_t length;
+    while ((length = binlogRead(chunk, sizeof(chunk))) > 0) {
+      for (size_t i = 0; i < length; i++) {
+        sprintf(hex + i * 2, "%02x", chunk[i]);
+      }
+      DLOG("BL %s\n", hex);
+    }
   } else if (cmd == "esprestart") {
     DLOG("Reboot ESP...");
     ESP.restart();
@@ -357,165 +1465,685 @@ void debugCallback() {
   }
 }
 
-bool parseRoombaStateFromStreamPacket(uint8_t *packet, int length, RoombaState *state) {
-  state->timestamp = millis();
-  //DLOG("Parse new packet ...\n");
-  int j = 0;
-  while (j < length) {
-    //DLOG("%d,",packet[j]);
-    j += 1;
+// Sensor events
+// Fired on the frame a bump, cliff, wheel drop, virtual wall or overcurrent
+// starts, and armed again once it has been clear for EVENT_RELEASE_FRAMES.
+typedef enum {
+  EventBumpRight = 0,
+  EventBumpLeft,
+  EventWheelDropRight,
+  EventWheelDropLeft,
+  EventWheelDropCaster,
+  EventCliffLeft,
+  EventCliffFrontLeft,
+  EventCliffFrontRight,
+  EventCliffRight,
+  EventVirtualWall,
+  EventOvercurrentSideBrush,
+  EventOvercurrentMainBrush,
+  EventOvercurrentRightWheel,
+  EventOvercurrentLeftWheel,
+  EventCount
+} SensorEvent;
+
+const char *sensorEventNames[EventCount] = {
+  "bump_right", "bump_left", "wheeldrop_right", "wheeldrop_left", "wheeldrop_caster",
+  "cliff_left", "cliff_front_left", "cliff_front_right", "cliff_right", "virtual_wall",
+  "overcurrent_side_brush", "overcurrent_main_brush", "overcurrent_right_wheel", "overcurrent_left_wheel"
+};
+
+uint16_t activeEvents = 0;
+uint8_t eventReleaseFrames[EventCount];
+
+uint16_t sensorEventBits(const RoombaState &state) {
+  // The bump and wheel drop bits are in the order of the event enum
+  uint16_t bits = state.bumpsAndWheelDrops & (ROOMBA_MASK_BUMP_RIGHT | ROOMBA_MASK_BUMP_LEFT
+      | ROOMBA_MASK_WHEELDROP_RIGHT | ROOMBA_MASK_WHEELDROP_LEFT | ROOMBA_MASK_WHEELDROP_CASTER);
+  bits |= (uint16_t)(state.cliffs & 0xF) << EventCliffLeft;
+  if (state.virtualWall) {
+    bits |= 1 << EventVirtualWall;
   }
-  //DLOG("\n");
-  int i = 0;
-  while (i < length) {
-    switch(packet[i]) {
-      case Roomba::Sensors7to26: // 0
-        i += 27;
-        break;
-      case Roomba::Sensors7to16: // 1
-        i += 11;
-        break;
-      case Roomba::SensorVirtualWall: // 13
-        i += 2;
-        break;
-      case Roomba::SensorDistance: // 19
-        state->distance = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorChargingState: // 21
-        state->chargingState = packet[i+1];
-        i += 2;
-        break;
-      case Roomba::SensorVoltage: // 22
-        state->voltage = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorCurrent: // 23
-        state->current = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorBatteryTemperature: //24
-        state->temp = packet[i+1];
-        i += 2;
-        break;
-      case Roomba::SensorBatteryCharge: // 25
-        state->charge = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorBatteryCapacity: //26
-        state->capacity = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorChargingSourcesAvailable: //34
-        state->chargingSourcesAvailable = packet[i+1];
-        i += 2;
-        break;
-      case Roomba::SensorOIMode: //35
-        state->OIMode = packet[i+1];
-        i += 2;
-        break;
-      case Roomba::SensorBumpsAndWheelDrops: // 7
-        i += 2;
-        break;
-      case Roomba::SensorLeftEncoderCounts: //43
-        state->leftencodercounts = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorRightEncoderCounts: //44
-        state->rightencodercounts = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorStasis: //58
-        state->stasis = packet[i+1];
-        i += 2;
-        break;
-      case 128: // Unknown
-        i += 2;
-        break;
-      default:
-        VLOG("Unhandled Packet ID %d\n", packet[i]);
-        DLOG("Unhandled Packet ID %d\n", packet[i]);
-        return false;
-        break;
+  if (state.overcurrents & ROOMBA_MASK_SIDE_BRUSH) {
+    bits |= 1 << EventOvercurrentSideBrush;
+  }
+  if (state.overcurrents & ROOMBA_MASK_MAIN_BRUSH) {
+    bits |= 1 << EventOvercurrentMainBrush;
+  }
+  if (state.overcurrents & ROOMBA_MASK_RIGHT_WHEEL) {
+    bits |= 1 << EventOvercurrentRightWheel;
+  }
+  if (state.overcurrents & ROOMBA_MASK_LEFT_WHEEL) {
+    bits |= 1 << EventOvercurrentLeftWheel;
+  }
+  return bits;
+}
+
+// Returns the events that fired with this frame
+uint16_t detectSensorEvents(const RoombaState &state) {
+  uint16_t bits = sensorEventBits(state);
+  uint16_t fired = bits & ~activeEvents;
+  for (int i = 0; i < EventCount; i++) {
+    if (bits & (1 << i)) {
+      eventReleaseFrames[i] = 0;
+    } else if ((activeEvents & (1 << i)) && ++eventReleaseFrames[i] >= EVENT_RELEASE_FRAMES) {
+      activeEvents &= ~(1 << i);
     }
   }
-  return true;
+  activeEvents |= fired;
+  if (!fired) {
+    return 0;
+  }
+  StaticJsonBuffer<400> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  JsonArray& events = root.createNestedArray("events");
+  for (int i = 0; i < EventCount; i++) {
+    if (fired & (1 << i)) {
+      events.add(sensorEventNames[i]);
+    }
+  }
+  root["timestamp"] = state.timestamp;
+  String jsonStr;
+  root.printTo(jsonStr);
+  VLOG("Sensor events %x\n", fired);
+  mqttPublish(eventTopic, jsonStr.c_str());
+  return fired;
+}
+
+// Encoder counts since the previous frame
+int16_t lastLeftEncoder;
+int16_t lastRightEncoder;
+unsigned long lastEncoderFrameTime = 0;
+
+// Returns false if the previous frame is too old for the counts to mean anything
+bool encoderCounts(const RoombaState &state, unsigned long now, int16_t *left, int16_t *right) {
+  bool valid = lastEncoderFrameTime != 0 && now - lastEncoderFrameTime <= MOTION_WINDOW_MS;
+  // The counters wrap around
+  *left = state.leftencodercounts - lastLeftEncoder;
+  *right = state.rightencodercounts - lastRightEncoder;
+  lastLeftEncoder = state.leftencodercounts;
+  lastRightEncoder = state.rightencodercounts;
+  lastEncoderFrameTime = now;
+  return valid;
+}
+
+// Motion monitor
+// Compares what the wheels do (encoders, motor current) with what the robot
+// does (stasis, bumps) to notice when it's stuck, slipping or spinning.
+typedef enum {
+  MotionOK = 0,
+  MotionStuck,
+  MotionSlipping,
+  MotionSpinning,
+  MotionConditionCount
+} MotionCondition;
+
+const char *motionConditionNames[MotionConditionCount] = {"ok", "stuck", "slipping", "spinning"};
+
+typedef struct {
+  unsigned long start;
+  int32_t left; // Encoder counts
+  int32_t right;
+  uint16_t frames;
+  uint16_t stasisFrames; // Frames with forward progress
+  bool stasisDisabled;
+  bool driven;
+  bool stalled;
+  bool bumped;
+} MotionWindow;
+
+MotionWindow motionWindow = {};
+// One bit per window, set if it had a bump
+uint16_t bumpHistory = 0;
+uint8_t motionCandidate = MotionOK;
+unsigned long motionCandidateTime = 0;
+uint8_t motionCondition = MotionOK;
+
+uint8_t evaluateMotionWindow(const MotionWindow &w) {
+  bumpHistory = bumpHistory << 1 | w.bumped;
+  if (!w.driven) {
+    return MotionOK;
+  }
+  bool leftTurning = abs(w.left) >= MOTION_MIN_COUNTS;
+  bool rightTurning = abs(w.right) >= MOTION_MIN_COUNTS;
+  if ((!leftTurning && !rightTurning && w.stalled)
+      || __builtin_popcount(bumpHistory) >= MOTION_BUMP_WINDOWS) {
+    return MotionStuck;
+  }
+  if (w.left >= MOTION_MIN_COUNTS && w.right >= MOTION_MIN_COUNTS
+      && !w.stasisDisabled && w.stasisFrames == 0) {
+    // Both wheels turn forward but the robot doesn't move
+    return MotionSlipping;
+  }
+  int32_t forward = w.left + w.right;
+  int32_t turn = w.left - w.right;
+  if (abs(turn) >= 4 * MOTION_MIN_COUNTS && abs(forward) * 8 < abs(turn)) {
+    return MotionSpinning;
+  }
+  return MotionOK;
+}
+
+void publishMotionCondition(unsigned long now) {
+  StaticJsonBuffer<100> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  root["motion"] = motionConditionNames[motionCondition];
+  root["timestamp"] = now;
+  String jsonStr;
+  root.printTo(jsonStr);
+  mqttPublish(eventTopic, jsonStr.c_str());
+}
+
+void updateMotion(const RoombaState &state, uint16_t events, bool hasCounts, int16_t left, int16_t right, unsigned long now) {
+  if (!hasCounts) {
+    motionWindow = {};
+    motionWindow.start = now;
+    return;
+  }
+  motionWindow.left += left;
+  motionWindow.right += right;
+  motionWindow.frames++;
+  if (state.stasis & 0x1) {
+    motionWindow.stasisFrames++;
+  }
+  motionWindow.stasisDisabled |= (state.stasis & 0x2) != 0;
+  int16_t wheelCurrent = max(abs(state.leftMotorCurrent), abs(state.rightMotorCurrent));
+  motionWindow.driven |= wheelCurrent >= MOTION_DRIVE_CURRENT_MA;
+  motionWindow.stalled |= wheelCurrent >= MOTION_STALL_CURRENT_MA;
+  motionWindow.bumped |= (events & (1 << EventBumpLeft | 1 << EventBumpRight)) != 0;
+  if (now - motionWindow.start < MOTION_WINDOW_MS) {
+    return;
+  }
+
+  uint8_t condition = evaluateMotionWindow(motionWindow);
+  motionWindow = {};
+  motionWindow.start = now;
+  if (condition != motionCandidate) {
+    motionCandidate = condition;
+    motionCandidateTime = now;
+  }
+  uint32_t hold = condition == MotionSpinning ? MOTION_SPIN_ALERT_MS : MOTION_ALERT_MS;
+  if (condition != motionCondition && now - motionCandidateTime >= hold) {
+    DLOG("Motion %s\n", motionConditionNames[condition]);
+    motionCondition = condition;
+    publishMotionCondition(now);
+  }
+}
+
+// Runtime predictor
+// Estimates how long the battery lasts at the recent discharge rate and how
+// long the way back to the dock takes, and sends the robot home before the
+// first catches up with the second. Integer arithmetic only.
+unsigned long runtimeUndockTime = 0;
+int32_t runtimeCurrentAvg = 0; // mA, Q4
+int32_t runtimeChargeRate = 0; // mA, measured from the drop in charge
+int16_t runtimeWindowCharge;
+unsigned long runtimeWindowTime;
+uint32_t runtimeOdometer = 0; // mm driven since leaving the dock
+uint32_t runtimeRemaining = 0; // s, only meaningful if runtimeValid
+bool runtimeValid = false; // Set once there is a discharge rate to estimate from
+uint32_t runtimeReturn = 0; // s
+bool runtimeDockSent = false;
+
+void resetRuntimePredictor(const RoombaState &state, unsigned long now) {
+  runtimeUndockTime = now;
+  runtimeCurrentAvg = (int32_t)-state.current << 4;
+  runtimeChargeRate = 0;
+  runtimeWindowCharge = state.charge;
+  runtimeWindowTime = now;
+  runtimeOdometer = 0;
+  runtimeRemaining = 0;
+  runtimeValid = false;
+  runtimeReturn = 0;
+  runtimeDockSent = false;
+}
+
+void updateRuntimePredictor(const RoombaState &state, unsigned long now) {
+  if (derived.onDock || runtimeUndockTime == 0) {
+    return;
+  }
+  runtimeCurrentAvg += (((int32_t)-state.current << 4) - runtimeCurrentAvg) >> RUNTIME_CURRENT_SHIFT;
+  runtimeOdometer += abs(state.distance);
+  if (now - runtimeWindowTime >= RUNTIME_CHARGE_WINDOW_MS) {
+    runtimeChargeRate = (int32_t)(runtimeWindowCharge - state.charge) * 3600 / (int32_t)((now - runtimeWindowTime) / 1000);
+    runtimeWindowCharge = state.charge;
+    runtimeWindowTime = now;
+  }
+  if (now - runtimeUndockTime < RUNTIME_WARMUP_MS) {
+    return;
+  }
+
+  // Whichever is worse, the charge counter lags but the current is noisy
+  int32_t draw = max(runtimeCurrentAvg >> 4, runtimeChargeRate);
+  int32_t usable = state.charge - (int32_t)state.capacity * RUNTIME_RESERVE_PERCENT / 100;
+  runtimeValid = draw > 0;
+  runtimeRemaining = runtimeValid && usable > 0 ? (uint32_t)usable * 3600 / draw : 0;
+  uint32_t returnDistance = min(coverageDistanceFromStart() * RUNTIME_RETURN_PATH_FACTOR, runtimeOdometer);
+  runtimeReturn = returnDistance / RUNTIME_RETURN_SPEED_MM_S + RUNTIME_DOCK_SEARCH_S;
+
+  if (runtimeValid && state.cleaning && !state.returning && !runtimeDockSent
+      && runtimeRemaining * 256 <= runtimeReturn * RUNTIME_RETURN_MARGIN) {
+    DLOG("Returning to base, %us of runtime left and %us to get back\n", runtimeRemaining, runtimeReturn);
+    runtimeDockSent = true;
+    roombaState.returning = true;
+    roombaState.cleaning = false;
+    roomba.dock();
+    StaticJsonBuffer<200> jsonBuffer;
+    JsonObject& root = jsonBuffer.createObject();
+    JsonArray& events = root.createNestedArray("events");
+    events.add("returning_low_runtime");
+    root["runtimeRemaining"] = runtimeRemaining;
+    root["returnTime"] = runtimeReturn;
+    root["timestamp"] = now;
+    String jsonStr;
+    root.printTo(jsonStr);
+    mqttPublish(eventTopic, jsonStr.c_str());
+  }
+}
+
+void addRuntimeInfo(JsonObject &root) {
+  if (runtimeValid) {
+    root["runtimeRemaining"] = runtimeRemaining;
+  }
+  root["returnTime"] = runtimeReturn;
+  root["dischargeRate"] = max(runtimeCurrentAvg >> 4, runtimeChargeRate);
 }
 
 void verboseLogPacket(uint8_t *packet, uint8_t length) {
-    VLOG("Packet: ");
-    for (int i = 0; i < length; i++) {
-      VLOG("%d ", packet[i]);
-    }
-    VLOG("\n");
+    BLOG_BYTES("Packet: %s\n", packet, length);
 }
 
-void readSensorPacket() {
+void sendStatusHA();
+
+// Frames are decoded by ingestSensors() and handled in the loop, the two only
+// share frameRing. The ingest side never blocks and never touches the network,
+// so a loop stuck in WiFi or MQTT (a TLS handshake, a slow publish, a DNS
+// lookup) doesn't stall decoding: the stream parser stays in sync, the UART
+// doesn't overflow, and the backlog is handled in order once the loop is back.
+// On the ESP32 the ingest side is a task pinned to its own core, on the
+// ESP8266 it runs from a ticker, which gets to run whenever the loop yields
+// and between loop passes.
+typedef struct {
+  RoombaState state;
+  uint8_t packetLength;
+  bool parsed;
+} SensorFrame;
+
+SPSCRing<SensorFrame, FRAME_RING_SIZE> frameRing;
+#ifdef ESP32
+TaskHandle_t ingestTask;
+#else
+Ticker ingestTicker;
+#endif
+uint32_t frameBacklogMax;
+
+// Runs in the system context or in its own task, so it must not yield or log over the network
+void ingestSensors() {
   uint8_t packetLength;
-  bool received = roomba.pollSensors(roombaPacket, sizeof(roombaPacket), &packetLength);
-  if (received) {
-    RoombaState rs = {};
-    bool parsed = parseRoombaStateFromStreamPacket(roombaPacket, packetLength, &rs);
+  if (roomba.pollSensors(roombaPacket, sizeof(roombaPacket), &packetLength)) {
+    SensorFrame frame = {};
+    frame.packetLength = packetLength;
+    frame.parsed = parseRoombaStateFromStreamPacket(roombaPacket, packetLength, &frame.state);
     verboseLogPacket(roombaPacket, packetLength);
-    if (parsed && rs.temp != 0) {
-      bool currentlyReturning = roombaState.returning;
-      roombaState = rs;
-      roombaState.returning = currentlyReturning;
-      VLOG("Got Packet of len=%d! OIMode:%d Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh Stasis:%d\n", packetLength, roombaState.OIMode, roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity, roombaState.stasis);
-      //DLOG("Got Packet of len=%d! OIMode:%d Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh\n", packetLength, roombaState.OIMode, roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity);
-      //char pkg[180];
-      //sprintf(pkg, "Got Packet of len=%d! Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh\n", packetLength, roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity);
-      distanceSum += roombaState.distance;
-      //roombaState.cleaning = false;
-      //roombaState.docked = false;
-      if (roombaState.current < -400 && !roombaState.returning) {
-        roombaState.cleaning = true;
-        roombaState.docked = false;
-      } else if (roombaState.current > -50) {
-        roombaState.docked = true;
-        roombaState.cleaning = false;
-        roombaState.returning = false;
-      } else {
-        roombaState.cleaning = false;
-        roombaState.docked = false;
-      }
+    if (!frameRing.push(frame)) {
+      metricsCount(MetricFramesDropped);
+    }
+  }
+#if MQTT_TLS
+  // Also catches the heap low while the loop is inside a handshake
+  tlsSampleHeap();
+#endif
+}
+
+#ifdef ESP32
+void ingestTaskBody(void *) {
+  TickType_t wake = xTaskGetTickCount();
+  for (;;) {
+    ingestSensors();
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(SENSOR_INGEST_INTERVAL_MS));
+  }
+}
+#endif
+
+void startIngest() {
+#ifdef ESP32
+  xTaskCreatePinnedToCore(ingestTaskBody, "ingest", SENSOR_INGEST_TASK_STACK, NULL,
+                          SENSOR_INGEST_TASK_PRIORITY, &ingestTask, SENSOR_INGEST_TASK_CORE);
+#else
+  ingestTicker.attach_ms(SENSOR_INGEST_INTERVAL_MS, ingestSensors);
+#endif
+}
+
+void handleSensorFrame(const SensorFrame &frame) {
+  const RoombaState &rs = frame.state;
+  uint8_t packetLength = frame.packetLength;
+  // Handled after a backlog, the times are those of the frame
+  unsigned long now = rs.timestamp;
+  if (frame.parsed && rs.temp != 0) {
+    bool currentlyReturning = roombaState.returning;
+    onWakeFrame(now, roombaState.OIMode, rs.OIMode);
+    if (bootFirstFrameTime == 0) {
+      bootFirstFrameTime = now;
+    }
+    bool wasOnDock = derived.valid && derived.onDock;
+    updateDerived(roombaState, rs);
+    roombaState = rs;
+    roombaState.returning = currentlyReturning;
+    VLOG("Got Packet of len=%d! OIMode:%d Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh Stasis:%d\n", packetLength, roombaState.OIMode, roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity, roombaState.stasis);
+    //DLOG("Got Packet of len=%d! OIMode:%d Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh\n", packetLength, roombaState.OIMode, roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity);
+    //char pkg[180];
+    //sprintf(pkg, "Got Packet of len=%d! Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh\n", packetLength, roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity);
+    distanceSum += roombaState.distance;
+    //roombaState.cleaning = false;
+    //roombaState.docked = false;
+    if (roombaState.current < -400 && !roombaState.returning) {
+      roombaState.cleaning = true;
+      roombaState.docked = false;
+    } else if (roombaState.current > -50) {
+      roombaState.docked = true;
+      roombaState.cleaning = false;
+      roombaState.returning = false;
     } else {
-      VLOG("Failed to parse packet\n");
-      DLOG("Failed to parse packet, packetLength:%d, Temperature:%d\n", packetLength, rs.temp);
-      //mqttClient.publish(debugTopic,"Failed to parse packet");
+      roombaState.cleaning = false;
+      roombaState.docked = false;
+    }
+    if (wasOnDock && !derived.onDock) {
+      DLOG("Left the dock, starting a new coverage map\n");
+      coverageReset();
+      resetRuntimePredictor(roombaState, now);
+    }
+    // Let Home Assistant know right away, once the first state is out
+    if ((derived.changed & DerivedOnDock) && bootFirstPublishTime != 0) {
+      sendStatusHA();
+    }
+    uint16_t events = detectSensorEvents(roombaState);
+    int16_t leftCounts, rightCounts;
+    bool hasCounts = encoderCounts(roombaState, now, &leftCounts, &rightCounts);
+    updateMotion(roombaState, events, hasCounts, leftCounts, rightCounts, now);
+    if (hasCounts) {
+      coverageUpdate(leftCounts, rightCounts, (events & (1 << EventBumpLeft | 1 << EventBumpRight)) != 0);
     }
+    updateRuntimePredictor(roombaState, now);
+    observeCommands(now);
+    broadcastLiveFrame(now);
+    metricsCount(MetricFramesDecoded);
+  } else {
+    metricsCount(MetricParseFailures);
+    VLOG("Failed to parse packet\n");
+    DLOG("Failed to parse packet, packetLength:%d, Temperature:%d\n", packetLength, rs.temp);
+    //mqttClient.publish(debugTopic,"Failed to parse packet");
+  }
+}
+
+// Handles the frames decoded since the last call
+void readSensorFrames() {
+  uint32_t backlog = frameRing.size();
+  if (backlog > frameBacklogMax) {
+    frameBacklogMax = backlog;
+  }
+  SensorFrame frame;
+  while (frameRing.pop(&frame)) {
+    handleSensorFrame(frame);
+  }
+}
+
+void publishOTAState(const char *state, unsigned int progress, unsigned int total, const char *error) {
+  if (!mqttClient.connected()) {
+    return;
   }
+  unsigned long elapsed = millis() - otaStartTime;
+  StaticJsonBuffer<200> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  root["state"] = state;
+  if (total > 0) {
+    root["progress"] = (uint32_t)((uint64_t)progress * 100 / total);
+    root["bytes"] = progress;
+    root["total"] = total;
+  }
+  root["elapsed"] = elapsed;
+  if (elapsed > 0) {
+    root["rate"] = (uint32_t)((uint64_t)progress * 1000 / elapsed); // bytes per second
+  }
+  if (error) {
+    root["error"] = error;
+  }
+  String jsonStr;
+  root.printTo(jsonStr);
+  mqttPublish(otaTopic, jsonStr.c_str());
 }
 
 void onOTAStart() {
   DLOG("Starting OTA session\n");
+  setPowerState(PowerStateActive);
   DLOG("Pause streaming\n");
   roomba.streamCommand(Roomba::StreamCommandPause);
   OTAStarted = true;
+  loopStage(LoopStageOTA);
+  otaStartTime = otaProgressTime = otaReportTime = millis();
+  otaProgress = otaTotal = 0;
+  publishOTAState("start", 0, 0, NULL);
+}
+
+// The transfer blocks the loop, so MQTT isn't serviced until it ends. Progress
+// only goes to telnet, the outcome is published with the final counts.
+void onOTAProgress(unsigned int progress, unsigned int total) {
+  unsigned long now = millis();
+  otaProgressTime = now;
+  otaProgress = progress;
+  otaTotal = total;
+  if (now - otaReportTime >= OTA_PROGRESS_INTERVAL_MS) {
+    otaReportTime = now;
+    DLOG("OTA progress %u/%u bytes\n", progress, total);
+  }
+}
+
+// The image (plain or gzip compressed) has been written and its MD5 verified.
+// ArduinoOTA reboots into it right after this.
+void onOTAEnd() {
+  DLOG("OTA update complete\n");
+  publishOTAState("complete", otaProgress, otaTotal, NULL);
+  mqttClient.loop();
+}
+
+// Leaves OTA mode and resumes normal operation. The old image stays active.
+void abortOTA(const char *reason) {
+  DLOG("OTA update failed: %s\n", reason);
+  publishOTAState("failed", otaProgress, otaTotal, reason);
+  OTAStarted = false;
+  DLOG("Resume streaming\n");
+  roomba.streamCommand(Roomba::StreamCommandResume);
+  streamPaused = false;
+}
+
+void onOTAError(ota_error_t error) {
+  switch (error) {
+    case OTA_AUTH_ERROR:
+      abortOTA("auth");
+      break;
+    case OTA_BEGIN_ERROR:
+      abortOTA("begin");
+      break;
+    case OTA_CONNECT_ERROR:
+      abortOTA("connect");
+      break;
+    case OTA_RECEIVE_ERROR:
+      abortOTA("receive");
+      break;
+    case OTA_END_ERROR:
+      abortOTA("verify");
+      break;
+    default:
+      abortOTA("unknown");
+      break;
+  }
+}
+
+// WiFi link supervisor
+unsigned long linkStateTime = 0;
+uint32_t linkBackoff = WIFI_BACKOFF_MIN_MS;
+bool networkServicesStarted = false;
+bool fastConnecting = false; // The current attempt uses the cached channel and BSSID
+
+void setLinkState(uint8_t state, unsigned long now) {
+  linkState = state;
+  linkStateTime = now;
+}
+
+// Starts connecting without waiting. Tries the cached channel and BSSID first,
+// which skips the scan. The address always comes from DHCP, a cached lease
+// would outlive its expiry and could collide with another host.
+void beginWiFi(bool useCache) {
+  WiFi.config(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+  fastConnecting = useCache && settings.wifiChannel != 0;
+  if (fastConnecting) {
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD, settings.wifiChannel, settings.wifiBssid);
+  } else {
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  }
+  setLinkState(LinkStateConnecting, millis());
 }
 
+void startNetworkServices();
+
+void onWiFiConnected(unsigned long now) {
+  DLOG("WiFi connected\n");
+  setLinkState(LinkStateConnected, now);
+  linkBackoff = WIFI_BACKOFF_MIN_MS;
+  if (!networkServicesStarted) {
+    bootWifiTime = now;
+    bootFastConnect = fastConnecting;
+    startNetworkServices();
+  }
+
+  // Remember this connection for the next boot. Only writes flash if it changed.
+  settings.wifiChannel = WiFi.channel();
+  memcpy(settings.wifiBssid, WiFi.BSSID(), sizeof(settings.wifiBssid));
+  saveSettings();
+
+  // Connect to MQTT right away instead of waiting for the reconnect interval
+  lastConnectTime = now - settings.reconnectInterval - 1;
+}
+
+// Never blocks: network tasks are skipped while the link is down, everything else keeps running
+void updateWiFiLink(unsigned long now) {
+  bool connected = WiFi.status() == WL_CONNECTED;
+  switch (linkState) {
+    case LinkStateConnected:
+      if (!connected) {
+        DLOG("WiFi connection lost\n");
+        metricsCount(MetricWiFiDisconnects);
+        // The session is gone with the link, don't let anything write to the dead socket
+        wifiClient.stop();
+        mqttClient.disconnect();
+        // The SDK reconnects on its own, give it a chance first
+        fastConnecting = false;
+        setLinkState(LinkStateConnecting, now);
+      }
+      break;
+    case LinkStateConnecting:
+      if (connected) {
+        onWiFiConnected(now);
+      } else if (fastConnecting && now - linkStateTime > WIFI_FAST_CONNECT_TIMEOUT_MS) {
+        DLOG("Fast WiFi connect failed, scanning\n");
+        WiFi.disconnect();
+        beginWiFi(false);
+      } else if (now - linkStateTime > WIFI_CONNECT_TIMEOUT_MS) {
+        DLOG("WiFi connect timed out, retrying in %ums\n", linkBackoff);
+        WiFi.disconnect();
+        setLinkState(LinkStateBackoff, now);
+      }
+      break;
+    case LinkStateBackoff:
+      if (connected) {
+        onWiFiConnected(now);
+      } else if (now - linkStateTime > linkBackoff) {
+        linkBackoff = min(linkBackoff * 2, (uint32_t)WIFI_BACKOFF_MAX_MS);
+        beginWiFi(false);
+      }
+      break;
+  }
+}
+
+void addBootInfo(JsonObject &root) {
+  root["BootFastConnect"] = bootFastConnect;
+  root["BootWiFi"] = bootWifiTime;
+  root["BootMQTT"] = bootMqttTime;
+  root["BootFirstFrame"] = bootFirstFrameTime;
+  root["BootFirstPublish"] = bootFirstPublishTime;
+}
+
+#if MQTT_TLS
+void addTLSInfo(JsonObject &root) {
+  JsonObject &tls = root.createNestedObject("TLS");
+  tls["HandshakeMs"] = tlsStats.lastMs;
+  tls["Resumed"] = tlsStats.lastResumed;
+  tls["Handshakes"] = tlsStats.handshakes;
+  tls["Resumptions"] = tlsStats.resumptions;
+  tls["HeapPeak"] = tlsStats.heapPeak;
+  tls["HeapHeld"] = tlsStats.heapHeld;
+}
+#endif
+
 void setup() {
   // High-impedence on the BRC_PIN
   pinMode(BRC_PIN,INPUT);
 
+  loadSettings();
+  wakeInterval = settings.wakeInitialInterval;
+  watchdogBegin(settings.stallThreshold);
+  coverageReset();
+
   // Sleep immediately if ENABLE_ADC_SLEEP and the battery is low
   // sleepIfNecessary();
 
+  // Start the stream first so the first frame is ready by the time WiFi is up
+  roomba.setReceiveCallback(captureByte);
+#if MQTT_TLS
+  Serial.setRxBufferSize(TLS_SERIAL_RX_BUFFER_SIZE);
+#endif
+  roomba.start();
+  startIngest();
+  delay(100);
+
+  // Reset stream sensor values
+  roomba.stream({}, 0);
+  delay(100);
+
+  // Request sensor stream
+  roomba.stream(settings.sensors, settings.sensorCount);
+
   // Set Hostname.
-  String hostname(HOSTNAME);
-  WiFi.hostname(hostname);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  WiFi.hostname(HOSTNAME);
+  // Reconnect attempts must not rewrite the SDK's WiFi config in flash every time
+  WiFi.persistent(false);
+  // The SDK starts in modem sleep, setPowerState() only switches on changes
+  WiFi.setSleepMode(WIFI_NONE_SLEEP);
+  beginWiFi(true);
 
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-  }
+#if MQTT_TLS
+  tlsBegin(wifiClient, MQTT_TLS_FINGERPRINT);
+  mqttClient.setServer(MQTT_SERVER, MQTT_TLS_PORT);
+#else
+  mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
+#endif
+  mqttClient.setCallback(mqttCallback);
+#if MQTT5
+  mqttClient.setUserProperty("schema", MQTT_SCHEMA_VERSION);
+  mqttClient.addTopicAlias(statusTopic);
+  mqttClient.addTopicAlias(statusHATopic);
+  mqttClient.addTopicAlias(eventTopic);
+  mqttClient.addTopicAlias(coverageTopic);
+  mqttClient.addTopicAlias(captureTopic);
+#endif
+}
 
+// Started once the first WiFi connection is up
+void startNetworkServices() {
+  String hostname(HOSTNAME);
   ArduinoOTA.setHostname((const char *)hostname.c_str());
   ArduinoOTA.begin();
   ArduinoOTA.onStart(onOTAStart);
-
-  mqttClient.setServer(MQTT_SERVER, 1883);
-  mqttClient.setCallback(mqttCallback);
+  ArduinoOTA.onProgress(onOTAProgress);
+  ArduinoOTA.onEnd(onOTAEnd);
+  ArduinoOTA.onError(onOTAError);
 
   #if LOGGING
   Debug.begin((const char *)hostname.c_str());
@@ -524,28 +2152,43 @@ void setup() {
   Debug.setSerialEnabled(false);
   #endif
 
-  roomba.start();
-  delay(100);
-
-  // Reset stream sensor values
-  roomba.stream({}, 0);
-  delay(100);
-
-  // Request sensor stream
-  DLOG("SensorsSize:%d\n",sizeof(sensors));
-  roomba.stream(sensors, sizeof(sensors));
+  webSocket.begin();
+  webSocket.onEvent(webSocketEvent);
+  metricsBegin(METRICS_PORT);
+  networkServicesStarted = true;
 }
 
 void reconnect() {
   DLOG("Attempting MQTT connection...\n");
   // Attempt to connect
+#if MQTT_TLS
+  tlsConnectStart();
+#endif
   //if (mqttClient.connect(HOSTNAME, MQTT_USER, MQTT_PASSWORD)) {
-    if (mqttClient.connect(HOSTNAME, lwtTopic, 0, true, lwtMessage)) {
+  // Persistent session, so commands published while offline are delivered after reconnecting
+#if MQTT5
+  bool connected = mqttClient.connect(MQTT_CLIENT_ID, lwtTopic, 0, true, lwtMessage, false, MQTT_SESSION_EXPIRY_S);
+#else
+  bool connected = mqttClient.connect(MQTT_CLIENT_ID, NULL, NULL, lwtTopic, 0, true, lwtMessage, false);
+#endif
+#if MQTT_TLS
+  tlsConnectDone(connected);
+  if (connected) {
+    DLOG("TLS %s handshake took %lums, %u bytes of heap\n", tlsStats.lastResumed ? "resumed" : "full", tlsStats.lastMs, tlsStats.heapPeak);
+  }
+#endif
+  if (connected) {
     DLOG("MQTT connected\n");
-    mqttClient.subscribe(commandTopic);
+    metricsCount(MetricMQTTConnects);
+    if (bootMqttTime == 0) {
+      bootMqttTime = millis();
+    }
+    mqttClient.subscribe(commandTopic, 1);
     DLOG("MQTT command topic subscribed!\n");
+    mqttClient.subscribe(configTopic);
+    publishSettings(NULL);
     DLOG("Send info for roomba with MQTT\n");
-    StaticJsonBuffer<200> jsonBuffer;
+    StaticJsonBuffer<500> jsonBuffer;
     JsonObject& root = jsonBuffer.createObject();
     root["Hostname"] = WiFi.hostname();
     root["MACAddress"] = WiFi.macAddress();
@@ -553,11 +2196,60 @@ void reconnect() {
     root["RSSI"] = WiFi.RSSI();
     root["SSID"] = WiFi.SSID();
     root["COMPILE_DATE"] = __DATE__ " " __TIME__;
+    addBootInfo(root);
+#if MQTT_TLS
+    addTLSInfo(root);
+#endif
     String jsonStr;
     root.printTo(jsonStr);
-    mqttClient.publish(infoTopic, jsonStr.c_str());
+    mqttPublish(infoTopic, jsonStr.c_str());
   } else {
     DLOG("MQTT failed rc=%d try again in 5 seconds\n", mqttClient.state());
+    metricsCount(MetricMQTTConnectFailures);
+  }
+}
+
+// Publishes the coverage map tiles that changed since the last call
+void publishCoverage() {
+  uint8_t chunk[256];
+  size_t length;
+  while ((length = coverageRead(chunk, sizeof(chunk))) > 0) {
+    mqttPublish(coverageTopic, chunk, length);
+  }
+}
+
+// Uploads what the serial capture recorded so far
+void publishCapture() {
+  uint8_t chunk[CAPTURE_CHUNK_SIZE];
+  size_t length;
+  for (int i = 0; i < CAPTURE_CHUNKS_PER_LOOP && (length = captureRead(chunk, sizeof(chunk))) > 0; i++) {
+    mqttPublish(captureTopic, chunk, length);
+  }
+}
+
+// Reports the most recent loop stall, including one that happened before a reset
+void publishStallRecord() {
+  StallRecord record;
+  if (!mqttClient.connected() || !watchdogPendingRecord(&record)) {
+    return;
+  }
+  StaticJsonBuffer<400> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  root["stage"] = loopStageNames[record.stage < LoopStageCount ? record.stage : LoopStageIdle];
+  root["duration"] = record.duration;
+  root["uptime"] = record.uptime;
+  root["crashed"] = (bool)record.crashed;
+  if (record.resetReason != STALL_NO_RESET) {
+    root["resetReason"] = record.resetReason;
+  }
+  JsonArray& stack = root.createNestedArray("stack");
+  for (int i = 0; i < STALL_STACK_WORDS; i++) {
+    stack.add(record.stack[i]);
+  }
+  String jsonStr;
+  root.printTo(jsonStr);
+  if (mqttPublish(stallTopic, jsonStr.c_str(), true)) {
+    watchdogMarkPublished();
   }
 }
 
@@ -567,13 +2259,11 @@ void sendStatus() {
     return;
   }
   DLOG("Reporting packet Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh\n", roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity);
-  StaticJsonBuffer<300> jsonBuffer;
+  StaticJsonBuffer<600> jsonBuffer;
   JsonObject& root = jsonBuffer.createObject();
   root["cleaning"] = roombaState.cleaning;
-  root["docked"] = roombaState.chargingSourcesAvailable == Roomba::ChargeAvailableDock;
-  root["charging"] = roombaState.chargingState == Roomba::ChargeStateReconditioningCharging
-  || roombaState.chargingState == Roomba::ChargeStateFullCharging
-  || roombaState.chargingState == Roomba::ChargeStateTrickleCharging;
+  root["docked"] = derived.onDock;
+  root["charging"] = derived.charging;
   root["chargingState"] = roombaState.chargingState;
   root["voltage"] = roombaState.voltage;
   root["current"] = roombaState.current;
@@ -581,14 +2271,18 @@ void sendStatus() {
   root["capacity"] = roombaState.capacity;
   root["distance"] = roombaState.distance;
   root["distanceSum"] = distanceSum;
-  root["batteryLevel"] = (int)(((float)roombaState.charge / (float)roombaState.capacity) * 100);
+  root["batteryLevel"] = derived.batteryPercent;
   root["batteryTemperature"] = roombaState.temp;
   root["chargingSourcesAvailable"] = roombaState.chargingSourcesAvailable;
   root["OIMode"] = roombaState.OIMode;
   root["stasis"] = roombaState.stasis;
+  root["motion"] = motionConditionNames[motionCondition];
+  root["coveredCells"] = coverageVisitedCells();
+  addRuntimeInfo(root);
+  root["adcVoltage"] = adcVoltage();
   String jsonStr;
   root.printTo(jsonStr);
-  mqttClient.publish(statusTopic, jsonStr.c_str());
+  mqttPublish(statusTopic, jsonStr.c_str());
 }
 
 void sendStatusHA() {
@@ -605,29 +2299,31 @@ void sendStatusHA() {
   else if (roombaState.cleaning){
     root["state"] = "cleaning";
   }
-  else if (roombaState.chargingSourcesAvailable == Roomba::ChargeAvailableDock){
+  else if (derived.onDock){
     root["state"] = "docked";
   }
   else {
     root["state"] = "idle"; // decided to go for state 'idle' since we cannot differ between standing around idling and having an error
   }
-  root["battery_level"] = (int)(((float)roombaState.charge / (float)roombaState.capacity) * 100);
+  root["battery_level"] = derived.batteryPercent;
   String jsonStr;
   root.printTo(jsonStr);
-  mqttClient.publish(statusHATopic, jsonStr.c_str(), true);
+  mqttPublish(statusHATopic, jsonStr.c_str(), true);
 }
 
 void sleepIfNecessary() {
   // Check the battery, if it's too low, sleep the ESP (so we don't murder the battery)
-  //float mV = readADC(10);
+  uint16_t mV = batteryVoltage(millis());
   // According to this post, you want to stop using NiMH batteries at about 0.9V per cell
   // https://electronics.stackexchange.com/a/35879 For a 12 cell battery like is in the Roomba,
   // That's 10.8 volts.
-  if ((roombaState.voltage < 10800 && roombaState.voltage > 0) || ((int)(((float)roombaState.charge / (float)roombaState.capacity) * 100) < 15)) {
+  if ((mV < 10800 && mV > 0) || (derived.valid && derived.batteryPercent < 15)) {
     // Fire off a quick message with our most recent state, if MQTT is connected
-    DLOG("Battery voltage is low (%.1fV). Sleeping for 10 minutes\n", (float)roombaState.voltage / 1000);
-    if (roombaState.cleaning || roombaState.returning){
-      roomba.cover();
+    DLOG("Battery voltage is low (%dmV). Sleeping for 10 minutes\n", mV);
+    // Send it home rather than stopping it where it is, and leave it alone if it's on its way already
+    if (roombaState.cleaning && !roombaState.returning) {
+      roombaState.returning = true;
+      roomba.dock();
     }
     if (mqttClient.connected()) { 
       sendStatus();
@@ -636,11 +2332,11 @@ void sleepIfNecessary() {
       JsonObject& root = jsonBuffer.createObject();
       //root["warning"] = "low battery - sleep 10 minutes";
       root["warning"] = "low battery - disabled cleaning";
-      root["voltage"] = roombaState.voltage;
-      root["batteryLevel"] = (int)(((float)roombaState.charge / (float)roombaState.capacity) * 100);
+      root["voltage"] = mV;
+      root["batteryLevel"] = derived.batteryPercent;
       String jsonStr;
       root.printTo(jsonStr);
-      mqttClient.publish(statusTopic, jsonStr.c_str(), true);
+      mqttPublish(statusTopic, jsonStr.c_str(), true);
       delay(200);
       stop_wakeup = true; // added bool to allow Roomba to enter power_saving mode - work in progress
       //ESP.deepSleep(600e6); - disabled due to not connected GPIO16 to RST
@@ -652,50 +2348,54 @@ void sleepIfNecessary() {
   }
 }
 
-int lastStateMsgTime = 0;
-int lastInfoMsgTime = 0;
-int lastWakeupTime = 0;
-int lastConnectTime = 0;
-
 void loop() {
+  unsigned long loopStart = micros();
+  loopStage(LoopStageWiFi);
+  updateWiFiLink(millis());
+  bool online = linkState == LinkStateConnected;
+
   // Important callbacks that _must_ happen every cycle
-  ArduinoOTA.handle();
+  loopStage(LoopStageNetwork);
+  if (networkServicesStarted) {
+    ArduinoOTA.handle();
+  }
   yield();
-  Debug.handle();
+  if (networkServicesStarted) {
+    Debug.handle();
+    webSocket.loop();
+    metricsHandle(millis());
+  }
 
   // Skip all other logic if we're running an OTA update
   if (OTAStarted) {
-    return;
+    if (millis() - otaProgressTime > OTA_STALL_TIMEOUT_MS) {
+      abortOTA("stalled");
+    } else {
+      loopStage(LoopStageOTA);
+      return;
+    }
   }
 
   long now = millis();
   // If MQTT client can't connect to broker, then reconnect every 30 seconds
-  if (!mqttClient.connected() && (now - lastConnectTime) > 30000) {
+  if (online && !mqttClient.connected() && (now - lastConnectTime) > (long)settings.reconnectInterval) {
+    loopStage(LoopStageMQTTConnect);
     DLOG("Reconnecting MQTT\n");
     lastConnectTime = now;
     reconnect();
   }
-  // Wakeup the roomba at fixed intervals - every 50 seconds
-  if (now - lastWakeupTime > 50000) {
-    DLOG("Wakeup Roomba now\n");
-    lastWakeupTime = now;
-    if (!roombaState.cleaning && !stop_wakeup && !roombaState.returning) {
-      if (roombaState.docked) {
-        //wakeOnDock(); - CB
-      } else {
-        wakeOffDock();
-        wakeup();
-      }
-    } else {
-      //wakeup(); - CB, no wakeup Roomba is cleaning!
-    }
-  }
+  // Keep the roomba awake, pulsing only when it is expected to fall asleep
+  loopStage(LoopStageWake);
+  updateWakeKeeper(now);
+  updateSongs(now);
+  expireCommands(now);
 
   // Report INFO
-  if(now - lastInfoMsgTime > 60000) {
+  if(online && now - lastInfoMsgTime > (long)settings.infoInterval) {
+    loopStage(LoopStageInfo);
     lastInfoMsgTime = now;
     DLOG("Send info for roomba with MQTT\n");
-    StaticJsonBuffer<200> jsonBuffer;
+    StaticJsonBuffer<900> jsonBuffer;
     JsonObject& root = jsonBuffer.createObject();
     int updays = millis()/86400000;
     int uphours = millis()/3600000 - updays*24;
@@ -710,21 +2410,32 @@ void loop() {
     root["RSSI"] = WiFi.RSSI();
     root["SSID"] = WiFi.SSID();
     root["COMPILE_DATE"] = __DATE__ " " __TIME__;
+    addPowerInfo(root);
+    addBootInfo(root);
+    root["WakeInterval"] = wakeInterval;
+    root["FrameBacklogMax"] = frameBacklogMax;
+    root["WiFiDisconnects"] = metricCounters[MetricWiFiDisconnects];
+    root["CmdCount"] = metricCounters[MetricCommands];
+    root["CmdFailed"] = metricCounters[MetricCommandsFailed];
+    root["CmdLatencyP50"] = commandLatencyPercentile(50);
+    root["CmdLatencyP99"] = commandLatencyPercentile(99);
+    addMemoryInfo(root);
     String jsonStr;
     root.printTo(jsonStr);
-    mqttClient.publish(infoTopic, jsonStr.c_str());
-    //roomba.stream(sensors, sizeof(sensors));
+    mqttPublish(infoTopic, jsonStr.c_str());
+    //roomba.stream(settings.sensors, settings.sensorCount);
     //readSensorPacket();
   }
 
   // Report the status over mqtt at fixed intervals
-  if (now - lastStateMsgTime > 10000) {
+  if (now - lastStateMsgTime > (long)settings.statusInterval) {
+    loopStage(LoopStageStatus);
     lastStateMsgTime = now;
-    if (now - roombaState.timestamp > 30000 || roombaState.sent) {
+    if (now - roombaState.timestamp > (long)settings.staleThreshold || roombaState.sent) {
       DLOG("Roomba state already sent (%.1fs old)\n", (now - roombaState.timestamp)/1000.0);
       DLOG("Request stream\n");
-      DLOG("SensorsSize:%d\n",sizeof(sensors));
-      roomba.stream(sensors, sizeof(sensors));
+      DLOG("SensorsSize:%d\n",settings.sensorCount);
+      roomba.stream(settings.sensors, settings.sensorCount);
     } else {
       DLOG("send roomba status\n");
       sendStatus();
@@ -734,6 +2445,41 @@ void loop() {
     sleepIfNecessary();
   }
 
-  readSensorPacket();
-  mqttClient.loop();
+  if (mqttClient.connected() && now - lastCoverageTime > COVERAGE_PUBLISH_INTERVAL_MS) {
+    loopStage(LoopStageStatus);
+    lastCoverageTime = now;
+    publishCoverage();
+  }
+
+  loopStage(LoopStageSensors);
+  readSensorFrames();
+  reportQuery();
+  captureFlush(millis());
+  if (mqttClient.connected() && (captureBuffered() >= CAPTURE_CHUNK_SIZE / 2
+      || now - lastCaptureTime >= CAPTURE_UPLOAD_INTERVAL_MS)) {
+    lastCaptureTime = now;
+    publishCapture();
+  }
+
+  // Publish the first state as soon as we have both a frame and a broker
+  if (bootFirstPublishTime == 0 && bootFirstFrameTime != 0 && mqttClient.connected()) {
+    DLOG("Send first roomba status\n");
+    sendStatus();
+    sendStatusHA();
+    roombaState.sent = true;
+    bootFirstPublishTime = millis();
+    lastStateMsgTime = bootFirstPublishTime;
+  }
+
+  sampleADC(millis());
+  sampleMemory(millis());
+  updatePowerState(millis());
+  if (online) {
+    loopStage(LoopStageMQTTLoop);
+    mqttClient.loop();
+    runQueuedCommand();
+    publishStallRecord();
+  }
+  loopStage(LoopStageIdle);
+  metricsLoopTime(micros() - loopStart);
 }
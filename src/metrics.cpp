@@ -0,0 +1,135 @@
+#include <ESP8266WiFi.h>
+#include "metrics.h"
+
+uint32_t metricCounters[MetricCount];
+
+static const char *metricNames[MetricCount] = {
+  "roomba_frames_decoded_total",
+  "roomba_frames_dropped_total",
+  "roomba_parse_failures_total",
+  "roomba_mqtt_publishes_total",
+  "roomba_mqtt_publishes_dropped_total",
+  "roomba_mqtt_connects_total",
+  "roomba_mqtt_connect_failures_total",
+  "roomba_wifi_disconnects_total",
+  "roomba_commands_total",
+  "roomba_commands_failed_total",
+  "roomba_commands_duplicate_total",
+  "roomba_commands_dropped_total"
+};
+
+static const uint32_t loopBuckets[METRICS_LOOP_BUCKET_COUNT] = METRICS_LOOP_BUCKETS;
+// The last bucket counts loops longer than all bounds
+static uint32_t loopBucketCounts[METRICS_LOOP_BUCKET_COUNT + 1];
+static uint64_t loopTimeSum = 0;
+static uint32_t loopTimeMax = 0;
+
+static WiFiServer *server = NULL;
+static WiFiClient client;
+static unsigned long clientTime;
+static char request[16];
+static uint8_t requestLength;
+
+static char buffer[METRICS_BUFFER_SIZE];
+static size_t bufferLength = 0;
+static unsigned long renderTime;
+
+static const char notFound[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+
+void metricsBegin(uint16_t port) {
+  static WiFiServer metricsServer(port);
+  server = &metricsServer;
+  server->begin();
+}
+
+void metricsLoopTime(uint32_t us) {
+  int bucket = 0;
+  while (bucket < METRICS_LOOP_BUCKET_COUNT && us > loopBuckets[bucket]) {
+    bucket++;
+  }
+  loopBucketCounts[bucket]++;
+  loopTimeSum += us;
+  if (us > loopTimeMax) {
+    loopTimeMax = us;
+  }
+}
+
+// Appends to the buffer, dropping whatever doesn't fit
+static void append(const char *format, ...) {
+  if (bufferLength >= sizeof(buffer)) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(buffer + bufferLength, sizeof(buffer) - bufferLength, format, args);
+  va_end(args);
+  if (written > 0) {
+    bufferLength = min(bufferLength + written, sizeof(buffer) - 1);
+  }
+}
+
+static void render(unsigned long now) {
+  bufferLength = 0;
+  // Reserve the headers, the length is only known at the end
+  append("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length:       \r\n\r\n");
+  size_t bodyStart = bufferLength;
+  for (int i = 0; i < MetricCount; i++) {
+    append("# TYPE %s counter\n%s %u\n", metricNames[i], metricNames[i], metricCounters[i]);
+  }
+  append("# TYPE roomba_loop_time_us histogram\n");
+  uint32_t cumulative = 0;
+  for (int i = 0; i < METRICS_LOOP_BUCKET_COUNT; i++) {
+    cumulative += loopBucketCounts[i];
+    append("roomba_loop_time_us_bucket{le=\"%u\"} %u\n", loopBuckets[i], cumulative);
+  }
+  cumulative += loopBucketCounts[METRICS_LOOP_BUCKET_COUNT];
+  append("roomba_loop_time_us_bucket{le=\"+Inf\"} %u\n", cumulative);
+  // In us like the buckets. Printed in two parts, printf may lack 64 bit support.
+  uint32_t sumHigh = loopTimeSum / 1000000000ULL;
+  uint32_t sumLow = loopTimeSum % 1000000000ULL;
+  if (sumHigh > 0) {
+    append("roomba_loop_time_us_sum %u%09u\n", sumHigh, sumLow);
+  } else {
+    append("roomba_loop_time_us_sum %u\n", sumLow);
+  }
+  append("roomba_loop_time_us_count %u\n", cumulative);
+  append("# TYPE roomba_loop_time_max_us gauge\nroomba_loop_time_max_us %u\n", loopTimeMax);
+  append("# TYPE roomba_heap_free_bytes gauge\nroomba_heap_free_bytes %u\n", ESP.getFreeHeap());
+  append("# TYPE roomba_wifi_rssi_dbm gauge\nroomba_wifi_rssi_dbm %d\n", WiFi.RSSI());
+  append("# TYPE roomba_uptime_seconds counter\nroomba_uptime_seconds %u\n", now / 1000);
+  char length[7];
+  snprintf(length, sizeof(length), "%u", (unsigned int)(bufferLength - bodyStart));
+  memcpy(buffer + bodyStart - 10, length, strlen(length));
+  renderTime = now;
+}
+
+void metricsHandle(unsigned long now) {
+  if (!server) {
+    return;
+  }
+  if (!client) {
+    client = server->available();
+    if (!client) {
+      return;
+    }
+    clientTime = now;
+    requestLength = 0;
+  }
+  // Only the start of the request line matters, the rest is discarded with the connection
+  while (client.available() && requestLength < sizeof(request)) {
+    request[requestLength++] = client.read();
+  }
+  if (requestLength < sizeof(request) && client.connected() && now - clientTime < METRICS_REQUEST_TIMEOUT_MS) {
+    return;
+  }
+  if (requestLength >= 13 && strncmp(request, "GET /metrics", 12) == 0
+      && (request[12] == ' ' || request[12] == '?')) {
+    if (bufferLength == 0 || now - renderTime >= METRICS_REFRESH_MS) {
+      render(now);
+    }
+    client.write((const uint8_t *)buffer, bufferLength);
+  } else if (client.connected()) {
+    client.write((const uint8_t *)notFound, sizeof(notFound) - 1);
+  }
+  client.stop();
+}
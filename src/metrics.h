@@ -0,0 +1,50 @@
+// Metrics scrape endpoint
+//
+// Counters are plain uint32_t increments in RAM. A scrape is answered from
+// a fixed text buffer in the Prometheus exposition format, re-rendered at
+// most once every METRICS_REFRESH_MS, so the cost of a scrape is bounded by
+// the buffer size no matter how often it happens. Nothing is allocated on
+// the heap. Only one scrape is served at a time.
+#ifndef metrics_h
+#define metrics_h
+
+#include <Arduino.h>
+
+#define METRICS_BUFFER_SIZE 2048
+#define METRICS_REFRESH_MS 1000
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+// Upper bounds in us of the loop time histogram buckets, +Inf is implied
+#define METRICS_LOOP_BUCKETS {1000, 5000, 20000, 100000, 500000}
+#define METRICS_LOOP_BUCKET_COUNT 5
+
+typedef enum {
+  MetricFramesDecoded = 0,
+  MetricFramesDropped,
+  MetricParseFailures,
+  MetricPublishesSent,
+  MetricPublishesDropped,
+  MetricMQTTConnects,
+  MetricMQTTConnectFailures,
+  MetricWiFiDisconnects,
+  MetricCommands,
+  MetricCommandsFailed,
+  MetricCommandDuplicates,
+  MetricCommandsDropped,
+  MetricCount
+} Metric;
+
+void metricsBegin(uint16_t port);
+
+// Records the duration of one pass of loop()
+void metricsLoopTime(uint32_t us);
+
+// Accepts and answers scrapes, call every loop
+void metricsHandle(unsigned long now);
+
+extern uint32_t metricCounters[MetricCount];
+
+inline void metricsCount(Metric metric) {
+  metricCounters[metric]++;
+}
+
+#endif
@@ -0,0 +1,442 @@
+#include "mqtt5.h"
+
+// Room left in front of the buffer for the fixed header, 1 byte type and up to 4 bytes length
+#define MQTT5_HEADER_SPACE 5
+
+#define MQTT5_CONNECT     0x10
+#define MQTT5_CONNACK     0x20
+#define MQTT5_PUBLISH     0x30
+#define MQTT5_PUBACK      0x40
+#define MQTT5_SUBSCRIBE   0x82
+#define MQTT5_PINGREQ     0xC0
+#define MQTT5_PINGRESP    0xD0
+#define MQTT5_DISCONNECT  0xE0
+
+#define MQTT5_PROPERTY_MESSAGE_EXPIRY    0x02
+#define MQTT5_PROPERTY_SESSION_EXPIRY    0x11
+#define MQTT5_PROPERTY_TOPIC_ALIAS_MAX   0x22
+#define MQTT5_PROPERTY_TOPIC_ALIAS       0x23
+#define MQTT5_PROPERTY_USER              0x26
+
+#define MQTT5_REASON_IMPLEMENTATION_ERROR 0x83
+
+MQTT5Client::MQTT5Client(Client &client) {
+  _client = &client;
+  _host = NULL;
+  _port = 1883;
+  _callback = NULL;
+  _userPropertyName = NULL;
+  _userPropertyValue = NULL;
+  _state = MQTT_DISCONNECTED;
+  _nextPacketId = 1;
+  _inboundPacketId = 0;
+  _inboundDuplicate = false;
+  _pingOutstanding = false;
+  _aliasCount = 0;
+  _aliasMax = 0;
+  _aliasesSent = 0;
+}
+
+MQTT5Client &MQTT5Client::setServer(const char *host, uint16_t port) {
+  _host = host;
+  _port = port;
+  return *this;
+}
+
+MQTT5Client &MQTT5Client::setCallback(Callback callback) {
+  _callback = callback;
+  return *this;
+}
+
+void MQTT5Client::setUserProperty(const char *name, const char *value) {
+  _userPropertyName = name;
+  _userPropertyValue = value;
+}
+
+bool MQTT5Client::addTopicAlias(const char *topic) {
+  if (_aliasCount == MQTT5_MAX_TOPIC_ALIASES) {
+    return false;
+  }
+  _aliases[_aliasCount++] = topic;
+  return true;
+}
+
+size_t MQTT5Client::putVarint(uint8_t *dest, uint32_t value) {
+  size_t n = 0;
+  do {
+    uint8_t b = value & 0x7F;
+    value >>= 7;
+    dest[n++] = value ? b | 0x80 : b;
+  } while (value);
+  return n;
+}
+
+// Returns the position after the string, 0 if it doesn't fit
+size_t MQTT5Client::putString(size_t pos, const char *s) {
+  size_t length = strlen(s);
+  if (pos == 0 || pos + 2 + length > sizeof(_buffer)) {
+    return 0;
+  }
+  _buffer[pos++] = length >> 8;
+  _buffer[pos++] = length & 0xFF;
+  memcpy(_buffer + pos, s, length);
+  return pos + length;
+}
+
+// Sends the packet whose variable header and payload were built at MQTT5_HEADER_SPACE
+bool MQTT5Client::writePacket(uint8_t header, size_t length) {
+  uint8_t lengthBytes[4];
+  size_t n = putVarint(lengthBytes, length);
+  uint8_t *start = _buffer + MQTT5_HEADER_SPACE - 1 - n;
+  start[0] = header;
+  memcpy(start + 1, lengthBytes, n);
+  size_t total = 1 + n + length;
+  _lastOutTime = millis();
+  return _client->write(start, total) == total;
+}
+
+bool MQTT5Client::readByte(uint8_t *b) {
+  unsigned long start = millis();
+  while (!_client->available()) {
+    if (!_client->connected() || millis() - start >= MQTT5_SOCKET_TIMEOUT_MS) {
+      return false;
+    }
+    yield();
+  }
+  *b = _client->read();
+  return true;
+}
+
+// Reads a whole packet into the buffer. Packets that don't fit are read, only
+// their start is kept, and false is returned with length set to their size.
+bool MQTT5Client::readPacket(uint8_t *type, size_t *length) {
+  uint8_t b;
+  if (!readByte(type)) {
+    return false;
+  }
+  uint32_t remaining = 0;
+  for (int shift = 0; shift < 28; shift += 7) {
+    if (!readByte(&b)) {
+      return false;
+    }
+    remaining |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  for (uint32_t i = 0; i < remaining; i++) {
+    if (!readByte(&b)) {
+      return false;
+    }
+    if (i < sizeof(_buffer)) {
+      _buffer[i] = b;
+    }
+  }
+  _lastInTime = millis();
+  *length = remaining;
+  return remaining <= sizeof(_buffer);
+}
+
+// Skips the properties at pos, picking out the ones we care about
+bool MQTT5Client::skipProperties(size_t *pos, size_t end, uint16_t *topicAliasMax) {
+  uint32_t length = 0;
+  for (int shift = 0; *pos < end && shift < 28; shift += 7) {
+    uint8_t b = _buffer[(*pos)++];
+    length |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+  size_t propertiesEnd = *pos + length;
+  if (propertiesEnd > end) {
+    return false;
+  }
+  while (*pos < propertiesEnd) {
+    uint8_t id = _buffer[(*pos)++];
+    size_t p = *pos;
+    switch (id) {
+      case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        p += 1;
+        break;
+      case 0x13: case 0x21: case 0x22: case 0x23:
+        if (id == MQTT5_PROPERTY_TOPIC_ALIAS_MAX && topicAliasMax && p + 2 <= propertiesEnd) {
+          *topicAliasMax = _buffer[p] << 8 | _buffer[p + 1];
+        }
+        p += 2;
+        break;
+      case 0x02: case 0x11: case 0x18: case 0x27:
+        p += 4;
+        break;
+      case 0x0B: // Variable byte integer
+        while (p < propertiesEnd && (_buffer[p] & 0x80)) {
+          p++;
+        }
+        p++;
+        break;
+      case 0x26: // String pair
+        if (p + 2 > propertiesEnd) {
+          return false;
+        }
+        // Skip the name, the value is a string like the ones below
+        p += 2 + (_buffer[p] << 8 | _buffer[p + 1]);
+        // fall through
+      case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        if (p + 2 > propertiesEnd) {
+          return false;
+        }
+        p += 2 + (_buffer[p] << 8 | _buffer[p + 1]);
+        break;
+      default:
+        return false;
+    }
+    *pos = p;
+  }
+  return *pos == propertiesEnd;
+}
+
+// reason is left out when it's success
+bool MQTT5Client::acknowledge(uint16_t packetId, uint8_t reason) {
+  size_t pos = MQTT5_HEADER_SPACE;
+  _buffer[pos++] = packetId >> 8;
+  _buffer[pos++] = packetId & 0xFF;
+  if (reason) {
+    _buffer[pos++] = reason;
+  }
+  return writePacket(MQTT5_PUBACK, pos - MQTT5_HEADER_SPACE);
+}
+
+void MQTT5Client::lost(int reason) {
+  _state = reason;
+  _client->stop();
+}
+
+bool MQTT5Client::connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage,
+                          bool cleanStart, uint32_t sessionExpiry) {
+  if (connected()) {
+    return true;
+  }
+  if (!_client->connect(_host, _port)) {
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  static const uint8_t protocol[] = {0, 4, 'M', 'Q', 'T', 'T', 5};
+  size_t pos = MQTT5_HEADER_SPACE;
+  memcpy(_buffer + pos, protocol, sizeof(protocol));
+  pos += sizeof(protocol);
+  uint8_t flags = cleanStart ? 0x02 : 0;
+  if (willTopic) {
+    flags |= 0x04 | (willQos & 0x3) << 3 | (willRetain ? 0x20 : 0);
+  }
+  _buffer[pos++] = flags;
+  _buffer[pos++] = MQTT5_KEEPALIVE_S >> 8;
+  _buffer[pos++] = MQTT5_KEEPALIVE_S & 0xFF;
+  if (sessionExpiry > 0) {
+    _buffer[pos++] = 5;
+    _buffer[pos++] = MQTT5_PROPERTY_SESSION_EXPIRY;
+    _buffer[pos++] = sessionExpiry >> 24;
+    _buffer[pos++] = sessionExpiry >> 16;
+    _buffer[pos++] = sessionExpiry >> 8;
+    _buffer[pos++] = sessionExpiry & 0xFF;
+  } else {
+    _buffer[pos++] = 0; // No properties
+  }
+  pos = putString(pos, id);
+  if (willTopic && pos) {
+    _buffer[pos++] = 0; // No will properties
+    pos = putString(pos, willTopic);
+    // Binary data is encoded like a string
+    pos = putString(pos, willMessage);
+  }
+  if (!pos || !writePacket(MQTT5_CONNECT, pos - MQTT5_HEADER_SPACE)) {
+    lost(MQTT_CONNECT_FAILED);
+    return false;
+  }
+
+  uint8_t type;
+  size_t length;
+  if (!readPacket(&type, &length)) {
+    lost(MQTT_CONNECTION_TIMEOUT);
+    return false;
+  }
+  if (type != MQTT5_CONNACK || length < 2) {
+    lost(MQTT_CONNECT_FAILED);
+    return false;
+  }
+  if (_buffer[1] != 0) {
+    lost(_buffer[1]);
+    return false;
+  }
+  _aliasMax = 0;
+  pos = 2;
+  if (length > 2 && !skipProperties(&pos, length, &_aliasMax)) {
+    lost(MQTT_CONNECT_FAILED);
+    return false;
+  }
+  _aliasesSent = 0;
+  _pingOutstanding = false;
+  _lastInTime = _lastOutTime = millis();
+  _state = MQTT_CONNECTED;
+  return true;
+}
+
+void MQTT5Client::disconnect() {
+  if (_state == MQTT_CONNECTED) {
+    writePacket(MQTT5_DISCONNECT, 0);
+  }
+  lost(MQTT_DISCONNECTED);
+}
+
+bool MQTT5Client::connected() {
+  if (_state == MQTT_CONNECTED && !_client->connected()) {
+    lost(MQTT_CONNECTION_LOST);
+  }
+  return _state == MQTT_CONNECTED;
+}
+
+int MQTT5Client::state() {
+  return _state;
+}
+
+bool MQTT5Client::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained, uint32_t expiry) {
+  if (!connected()) {
+    return false;
+  }
+  int alias = -1;
+  for (int i = 0; i < _aliasCount && i < _aliasMax; i++) {
+    if (strcmp(_aliases[i], topic) == 0) {
+      alias = i;
+      break;
+    }
+  }
+  bool aliasSent = alias >= 0 && (_aliasesSent & (1 << alias));
+  size_t pos = putString(MQTT5_HEADER_SPACE, aliasSent ? "" : topic);
+
+  size_t propertiesLength = (expiry ? 5 : 0) + (alias >= 0 ? 3 : 0);
+  if (_userPropertyName) {
+    propertiesLength += 5 + strlen(_userPropertyName) + strlen(_userPropertyValue);
+  }
+  if (!pos || pos + 4 + propertiesLength + length > sizeof(_buffer)) {
+    return false;
+  }
+  pos += putVarint(_buffer + pos, propertiesLength);
+  if (expiry) {
+    _buffer[pos++] = MQTT5_PROPERTY_MESSAGE_EXPIRY;
+    _buffer[pos++] = expiry >> 24;
+    _buffer[pos++] = expiry >> 16;
+    _buffer[pos++] = expiry >> 8;
+    _buffer[pos++] = expiry;
+  }
+  if (alias >= 0) {
+    _buffer[pos++] = MQTT5_PROPERTY_TOPIC_ALIAS;
+    _buffer[pos++] = 0;
+    _buffer[pos++] = alias + 1;
+  }
+  if (_userPropertyName) {
+    _buffer[pos++] = MQTT5_PROPERTY_USER;
+    pos = putString(pos, _userPropertyName);
+    pos = putString(pos, _userPropertyValue);
+  }
+  memcpy(_buffer + pos, payload, length);
+  pos += length;
+  if (!writePacket(MQTT5_PUBLISH | (retained ? 1 : 0), pos - MQTT5_HEADER_SPACE)) {
+    return false;
+  }
+  if (alias >= 0) {
+    _aliasesSent |= 1 << alias;
+  }
+  return true;
+}
+
+bool MQTT5Client::subscribe(const char *topic, uint8_t qos) {
+  if (!connected()) {
+    return false;
+  }
+  size_t pos = MQTT5_HEADER_SPACE;
+  _buffer[pos++] = _nextPacketId >> 8;
+  _buffer[pos++] = _nextPacketId & 0xFF;
+  _nextPacketId = _nextPacketId == 0xFFFF ? 1 : _nextPacketId + 1;
+  _buffer[pos++] = 0; // No properties
+  pos = putString(pos, topic);
+  if (!pos || pos >= sizeof(_buffer)) {
+    return false;
+  }
+  _buffer[pos++] = qos & 0x3; // Subscription options
+  return writePacket(MQTT5_SUBSCRIBE, pos - MQTT5_HEADER_SPACE);
+}
+
+bool MQTT5Client::loop() {
+  if (!connected()) {
+    return false;
+  }
+  unsigned long now = millis();
+  if (now - _lastInTime > MQTT5_KEEPALIVE_S * 1000UL || now - _lastOutTime > MQTT5_KEEPALIVE_S * 1000UL) {
+    if (_pingOutstanding) {
+      lost(MQTT_CONNECTION_TIMEOUT);
+      return false;
+    }
+    writePacket(MQTT5_PINGREQ, 0);
+    _lastInTime = now;
+    _pingOutstanding = true;
+  }
+  if (!_client->available()) {
+    return true;
+  }
+  uint8_t type;
+  size_t length = 0;
+  if (!readPacket(&type, &length)) {
+    if (!_client->connected()) {
+      lost(MQTT_CONNECTION_LOST);
+      return false;
+    }
+    // Too big for the buffer and dropped. A QoS 1 message is still acknowledged,
+    // otherwise the broker delivers it again on every reconnect.
+    if (length > sizeof(_buffer) && (type & 0xF0) == MQTT5_PUBLISH && ((type >> 1) & 0x3) == 1) {
+      size_t pos = 2 + (_buffer[0] << 8 | _buffer[1]);
+      if (pos + 2 <= sizeof(_buffer)) {
+        acknowledge(_buffer[pos] << 8 | _buffer[pos + 1], MQTT5_REASON_IMPLEMENTATION_ERROR);
+      }
+    }
+    return true;
+  }
+  switch (type & 0xF0) {
+    case MQTT5_PUBLISH: {
+      uint8_t qos = (type >> 1) & 0x3;
+      if (length < 2) {
+        break;
+      }
+      size_t topicLength = _buffer[0] << 8 | _buffer[1];
+      size_t pos = 2 + topicLength;
+      uint16_t packetId = 0;
+      if (qos > 0 && pos + 2 <= length) {
+        packetId = _buffer[pos] << 8 | _buffer[pos + 1];
+        pos += 2;
+      }
+      if (pos > length || !skipProperties(&pos, length, NULL)) {
+        break;
+      }
+      if (_callback) {
+        _inboundPacketId = packetId;
+        _inboundDuplicate = (type & 0x08) != 0;
+        // Move the topic down over its length to make room for the terminator
+        memmove(_buffer, _buffer + 2, topicLength);
+        _buffer[topicLength] = 0;
+        _callback((char *)_buffer, _buffer + pos, length - pos);
+        _inboundPacketId = 0;
+        _inboundDuplicate = false;
+      }
+      if (qos == 1) {
+        acknowledge(packetId, 0);
+      }
+      break;
+    }
+    case MQTT5_PINGRESP:
+      _pingOutstanding = false;
+      break;
+    case MQTT5_DISCONNECT:
+      lost(length > 0 ? _buffer[0] : MQTT_CONNECTION_LOST);
+      return false;
+    default:
+      break;
+  }
+  return true;
+}
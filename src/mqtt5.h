@@ -0,0 +1,96 @@
+// Minimal MQTT 5 client
+//
+// A drop-in for the parts of PubSubClient this firmware uses, speaking MQTT
+// 5 instead of 3.1.1, so publishes can carry properties:
+//  - Topic aliases for the topics added with addTopicAlias(): the first
+//    publish on a connection registers the alias, later ones send the two
+//    byte alias instead of the topic string. Only as many as the broker
+//    allows are used.
+//  - Message expiry, per publish, so retained telemetry of a dead device
+//    disappears from the broker.
+//  - A user property on every publish, e.g. the payload schema version.
+// Publishes are QoS 0. Subscriptions can be QoS 1, incoming messages are
+// acknowledged once the callback returns. Packets are built in and read into a single buffer of
+// MQTT_MAX_PACKET_SIZE bytes, the same limit as PubSubClient. Bigger incoming
+// messages are dropped, and a QoS 1 one is acknowledged with an error reason.
+#ifndef mqtt5_h
+#define mqtt5_h
+
+#include <Arduino.h>
+#include <Client.h>
+#include <PubSubClient.h>
+
+#define MQTT5_MAX_TOPIC_ALIASES 8
+#define MQTT5_KEEPALIVE_S 15
+// How long to wait for the rest of a packet, or for CONNACK
+#define MQTT5_SOCKET_TIMEOUT_MS 5000
+
+class MQTT5Client {
+public:
+  typedef void (*Callback)(char *topic, uint8_t *payload, unsigned int length);
+
+  MQTT5Client(Client &client);
+
+  MQTT5Client &setServer(const char *host, uint16_t port);
+  MQTT5Client &setCallback(Callback callback);
+
+  // Sent with every publish, NULL for none
+  void setUserProperty(const char *name, const char *value);
+
+  // Publishes to topic will use a topic alias. The topic must stay valid.
+  bool addTopicAlias(const char *topic);
+
+  // Same as PubSubClient::connect(). Without a clean start the broker keeps the
+  // session for sessionExpiry seconds after the connection is gone.
+  bool connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage,
+               bool cleanStart = true, uint32_t sessionExpiry = 0);
+  void disconnect();
+  bool connected();
+  // PubSubClient's MQTT_* states, or the CONNACK reason code
+  int state();
+
+  // expiry is the message expiry interval in seconds, 0 for none
+  bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained, uint32_t expiry = 0);
+  bool subscribe(const char *topic, uint8_t qos = 0);
+
+  // Packet ID of the message being passed to the callback, 0 for QoS 0
+  uint16_t inboundPacketId() { return _inboundPacketId; }
+  // True if that message has the DUP flag, i.e. it may have been delivered before
+  bool inboundDuplicate() { return _inboundDuplicate; }
+
+  // Handles keepalive and incoming packets, call every loop
+  bool loop();
+
+private:
+  bool readByte(uint8_t *b);
+  bool readPacket(uint8_t *type, size_t *length);
+  bool writePacket(uint8_t header, size_t length);
+  bool acknowledge(uint16_t packetId, uint8_t reason);
+  size_t putString(size_t pos, const char *s);
+  size_t putVarint(uint8_t *dest, uint32_t value);
+  bool skipProperties(size_t *pos, size_t end, uint16_t *topicAliasMax);
+  void lost(int reason);
+
+  Client *_client;
+  const char *_host;
+  uint16_t _port;
+  Callback _callback;
+  const char *_userPropertyName;
+  const char *_userPropertyValue;
+  int _state;
+  uint8_t _buffer[MQTT_MAX_PACKET_SIZE];
+  uint16_t _nextPacketId;
+  uint16_t _inboundPacketId;
+  bool _inboundDuplicate;
+  unsigned long _lastOutTime;
+  unsigned long _lastInTime;
+  bool _pingOutstanding;
+
+  // Topic alias n + 1 is _aliases[n]
+  const char *_aliases[MQTT5_MAX_TOPIC_ALIASES];
+  uint8_t _aliasCount;
+  uint16_t _aliasMax; // Topic Alias Maximum of the broker
+  uint8_t _aliasesSent; // Bit n is set once alias n + 1 was registered on this connection
+};
+
+#endif
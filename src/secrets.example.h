@@ -3,3 +3,5 @@
 #define MQTT_PASSWORD "mysecurepassword"
 #define WIFI_PASSWORD "mysecurepassword"
 #define WIFI_SSID "mywifissid"
+// SHA1 fingerprint of the broker certificate, only used with MQTT_TLS
+#define MQTT_TLS_FINGERPRINT "00 11 22 33 44 55 66 77 88 99 aa bb cc dd ee ff 00 11 22 33"
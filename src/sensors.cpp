@@ -0,0 +1,109 @@
+#include "sensors.h"
+#include "binlog.h"
+
+bool parseRoombaStateFromStreamPacket(uint8_t *packet, int length, RoombaState *state) {
+  state->timestamp = millis();
+  //DLOG("Parse new packet ...\n");
+  int j = 0;
+  while (j < length) {
+    //DLOG("%d,",packet[j]);
+    j += 1;
+  }
+  //DLOG("\n");
+  int i = 0;
+  while (i < length) {
+    switch(packet[i]) {
+      case Roomba::Sensors7to26: // 0
+        i += 27;
+        break;
+      case Roomba::Sensors7to16: // 1
+        i += 11;
+        break;
+      case Roomba::SensorCliffLeft: // 9
+      case Roomba::SensorCliffFrontLeft: // 10
+      case Roomba::SensorCliffFrontRight: // 11
+      case Roomba::SensorCliffRight: // 12
+        if (packet[i+1]) {
+          state->cliffs |= 1 << (packet[i] - Roomba::SensorCliffLeft);
+        }
+        i += 2;
+        break;
+      case Roomba::SensorVirtualWall: // 13
+        state->virtualWall = packet[i+1];
+        i += 2;
+        break;
+      case Roomba::SensorOvercurrents: // 14
+        state->overcurrents = packet[i+1];
+        i += 2;
+        break;
+      case Roomba::SensorDistance: // 19
+        state->distance = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorChargingState: // 21
+        state->chargingState = packet[i+1];
+        i += 2;
+        break;
+      case Roomba::SensorVoltage: // 22
+        state->voltage = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorCurrent: // 23
+        state->current = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorBatteryTemperature: //24
+        state->temp = packet[i+1];
+        i += 2;
+        break;
+      case Roomba::SensorBatteryCharge: // 25
+        state->charge = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorBatteryCapacity: //26
+        state->capacity = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorChargingSourcesAvailable: //34
+        state->chargingSourcesAvailable = packet[i+1];
+        i += 2;
+        break;
+      case Roomba::SensorOIMode: //35
+        state->OIMode = packet[i+1];
+        i += 2;
+        break;
+      case Roomba::SensorBumpsAndWheelDrops: // 7
+        state->bumpsAndWheelDrops = packet[i+1];
+        i += 2;
+        break;
+      case Roomba::SensorLeftEncoderCounts: //43
+        state->leftencodercounts = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorRightEncoderCounts: //44
+        state->rightencodercounts = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorLeftMotorCurrent: //54
+        state->leftMotorCurrent = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorRightMotorCurrent: //55
+        state->rightMotorCurrent = packet[i+1] * 256 + packet[i+2];
+        i += 3;
+        break;
+      case Roomba::SensorStasis: //58
+        state->stasis = packet[i+1];
+        i += 2;
+        break;
+      case 128: // Unknown
+        i += 2;
+        break;
+      default:
+        BLOG("Unhandled Packet ID %d\n", packet[i]);
+        return false;
+        break;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,50 @@
+// Sensor stream decoding
+//
+// Turns the packets of the Roomba's sensor stream, as returned by
+// Roomba::pollSensors(), into a RoombaState. Kept apart from the firmware's
+// networking, so tools/capture_replay.py can run captured serial data through
+// the same parser in the host build (test/stream_replay.cpp).
+#ifndef sensors_h
+#define sensors_h
+
+#include <Arduino.h>
+#include <Roomba.h>
+
+typedef struct {
+  // Sensor values
+  int16_t distance;
+  uint8_t chargingState;
+  uint16_t voltage;
+  int16_t current;
+  // Supposedly unsigned according to the OI docs, but I've seen it
+  // underflow to ~65000mAh, so I think signed will work better.
+  int16_t charge;
+  uint16_t capacity;
+  int16_t temp;
+  uint8_t chargingSourcesAvailable;
+  uint8_t OIMode;
+
+  int16_t leftencodercounts;
+  int16_t rightencodercounts;
+  uint8_t stasis;
+  uint8_t bumpsAndWheelDrops; // ROOMBA_MASK_BUMP_* and ROOMBA_MASK_WHEELDROP_*
+  uint8_t cliffs; // Bit 0 left, 1 front left, 2 front right, 3 right
+  uint8_t virtualWall;
+  uint8_t overcurrents; // ROOMBA_MASK_*_WHEEL, ROOMBA_MASK_MAIN_BRUSH and ROOMBA_MASK_SIDE_BRUSH
+  int16_t leftMotorCurrent;
+  int16_t rightMotorCurrent;
+
+  // Derived state
+  bool cleaning;
+  bool docked;
+  bool returning;
+
+  int timestamp;
+  bool sent;
+} RoombaState;
+
+// Decodes the sensor IDs and values of a stream packet into state and
+// timestamps it. Returns false on an unknown sensor ID.
+bool parseRoombaStateFromStreamPacket(uint8_t *packet, int length, RoombaState *state);
+
+#endif
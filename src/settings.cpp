@@ -0,0 +1,91 @@
+#include <EEPROM.h>
+#include <Roomba.h>
+#include "settings.h"
+#include "config.h"
+
+Settings settings;
+
+static const uint8_t defaultSensors[] = {
+  Roomba::SensorDistance, // PID 19, 2 bytes, mm, signed
+  Roomba::SensorChargingState, // PID 21, 1 byte
+  Roomba::SensorVoltage, // PID 22, 2 bytes, mV, unsigned
+  Roomba::SensorCurrent, // PID 23, 2 bytes, mA, signed
+  Roomba::SensorBatteryTemperature, // PID 24, 1 byte, signed
+  Roomba::SensorBatteryCharge, // PID 25, 2 bytes, mAh, unsigned
+  Roomba::SensorBatteryCapacity, // PID 26, 2 bytes, mAh, unsigned
+  Roomba::SensorChargingSourcesAvailable, // PID 34, 1 byte, unsigned
+  Roomba::SensorOIMode, // PID 35, 1 byte, unsigned
+  Roomba::SensorLeftEncoderCounts, // PID 43, 2 bytes, signed
+  Roomba::SensorRightEncoderCounts, // PID 44, 2 bytes, signed
+  Roomba::SensorStasis, // PID 58, 1 byte, unsigned
+  Roomba::SensorBumpsAndWheelDrops, // PID 7, 1 byte, ROOMBA_MASK_BUMP_* and ROOMBA_MASK_WHEELDROP_*
+  Roomba::SensorCliffLeft, // PID 9, 1 byte, boolean
+  Roomba::SensorCliffFrontLeft, // PID 10, 1 byte, boolean
+  Roomba::SensorCliffFrontRight, // PID 11, 1 byte, boolean
+  Roomba::SensorCliffRight, // PID 12, 1 byte, boolean
+  Roomba::SensorVirtualWall, // PID 13, 1 byte, boolean
+  Roomba::SensorOvercurrents, // PID 14, 1 byte, ROOMBA_MASK_*_WHEEL and ROOMBA_MASK_*_BRUSH
+  Roomba::SensorLeftMotorCurrent, // PID 54, 2 bytes, mA, signed
+  Roomba::SensorRightMotorCurrent // PID 55, 2 bytes, mA, signed
+};
+
+// Checksum over everything after the header
+static uint16_t settingsChecksum(const Settings *s, uint8_t length) {
+  const uint8_t *data = (const uint8_t *)s;
+  uint16_t sum = 0;
+  for (uint8_t i = offsetof(Settings, statusInterval); i < length; i++) {
+    sum = (sum << 1 | sum >> 15) + data[i];
+  }
+  return sum;
+}
+
+void resetSettings() {
+  memset(&settings, 0, sizeof(settings));
+  settings.magic = SETTINGS_MAGIC;
+  settings.version = SETTINGS_VERSION;
+  settings.length = sizeof(Settings);
+  settings.statusInterval = STATUS_INTERVAL_MS;
+  settings.infoInterval = INFO_INTERVAL_MS;
+  settings.reconnectInterval = RECONNECT_INTERVAL_MS;
+  settings.staleThreshold = STALE_THRESHOLD_MS;
+  settings.wakeInitialInterval = WAKE_INITIAL_INTERVAL_MS;
+  settings.wakeMinInterval = WAKE_MIN_INTERVAL_MS;
+  settings.wakeMaxInterval = WAKE_MAX_INTERVAL_MS;
+  settings.powerPolicy = POWER_POLICY;
+  settings.sensorCount = sizeof(defaultSensors);
+  memcpy(settings.sensors, defaultSensors, sizeof(defaultSensors));
+  settings.stallThreshold = LOOP_STALL_THRESHOLD_MS;
+}
+
+void loadSettings() {
+  resetSettings();
+  EEPROM.begin(sizeof(Settings));
+  Settings stored;
+  EEPROM.get(0, stored);
+  if (stored.magic != SETTINGS_MAGIC || stored.version > SETTINGS_VERSION
+      || stored.length > sizeof(Settings) || stored.length < offsetof(Settings, statusInterval)
+      || stored.checksum != settingsChecksum(&stored, stored.length)) {
+    return;
+  }
+  // Older versions are a prefix of the current layout. Version 1's length
+  // includes tail padding, which the fields of version 2 now occupy.
+  size_t length = stored.version < 2 ? offsetof(Settings, wifiChannel) : stored.length;
+  memcpy(&settings, &stored, length);
+  if (stored.version < 5) {
+    // Stream the sensors that were added to the defaults
+    for (uint8_t i = 0; i < sizeof(defaultSensors) && settings.sensorCount < SETTINGS_MAX_SENSORS; i++) {
+      if (!memchr(settings.sensors, defaultSensors[i], settings.sensorCount)) {
+        settings.sensors[settings.sensorCount++] = defaultSensors[i];
+      }
+    }
+  }
+  settings.version = SETTINGS_VERSION;
+  settings.length = sizeof(Settings);
+}
+
+void saveSettings() {
+  settings.checksum = settingsChecksum(&settings, sizeof(Settings));
+  EEPROM.put(0, settings);
+  // Only erases and writes the flash sector if something changed
+  EEPROM.commit();
+}
@@ -0,0 +1,68 @@
+// Runtime settings persisted to flash
+//
+// The settings are stored in EEPROM-emulated flash as a versioned binary
+// record. New fields must only ever be appended to Settings (and the
+// version bumped) so that older records can be migrated by keeping the
+// stored prefix and taking defaults for the rest. Each version has to end on
+// a 4 byte boundary, padded with reserved bytes if necessary, so the stored
+// length has no tail padding that later fields would take over. Version 1
+// doesn't, loadSettings() handles that.
+#ifndef settings_h
+#define settings_h
+
+#include <Arduino.h>
+
+#define SETTINGS_MAGIC 0x5253 // "RS"
+#define SETTINGS_VERSION 5
+#define SETTINGS_MAX_SENSORS 24
+
+typedef struct {
+  // Header
+  uint16_t magic;
+  uint8_t version;
+  uint8_t length;
+  uint16_t checksum;
+
+  // Version 1
+  uint32_t statusInterval;
+  uint32_t infoInterval;
+  uint32_t reconnectInterval;
+  uint32_t staleThreshold;
+  uint32_t wakeInitialInterval;
+  uint32_t wakeMinInterval;
+  uint32_t wakeMaxInterval;
+  uint8_t powerPolicy;
+  uint8_t sensorCount;
+  uint8_t sensors[SETTINGS_MAX_SENSORS];
+
+  // Version 2: last WiFi connection, for fast reconnects after a reset or power loss.
+  // wifiChannel is 0 if nothing is cached. The IP fields are no longer used,
+  // the address always comes from DHCP.
+  uint8_t wifiChannel;
+  uint8_t wifiBssid[6];
+  uint32_t wifiIP;
+  uint32_t wifiGateway;
+  uint32_t wifiSubnet;
+  uint32_t wifiDNS;
+
+  // Version 3
+  uint32_t stallThreshold;
+
+  // Versions 4 and 5 have no new fields, sensors were added to the
+  // defaults (bumps, cliffs, virtual wall and overcurrents in 4, wheel
+  // motor currents in 5)
+} Settings;
+
+extern Settings settings;
+
+// Fills settings with the compile time defaults from config.h
+void resetSettings();
+
+// Loads the settings from flash, migrating older versions. Falls back to
+// the defaults if nothing valid is stored.
+void loadSettings();
+
+// Writes the settings to flash if they differ from what is stored
+void saveSettings();
+
+#endif
@@ -0,0 +1,54 @@
+// Lock-free single producer, single consumer ring
+//
+// The producer only writes _head and the consumer only writes _tail, both
+// free running. Each side publishes its own index with release ordering and
+// reads the other one's with acquire ordering, so an entry is completely
+// written before the consumer can see it and isn't overwritten before the
+// consumer is done with it. No locks or disabled interrupts are needed,
+// whether the producer runs in a ticker or on another core.
+#ifndef spscring_h
+#define spscring_h
+
+#include <stdint.h>
+
+template <typename T, uint32_t N>
+class SPSCRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "SPSCRing size must be a power of two");
+
+public:
+  SPSCRing() : _head(0), _tail(0) {}
+
+  // Producer side. Returns false and drops item if the ring is full.
+  bool push(const T &item) {
+    uint32_t head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) == N) {
+      return false;
+    }
+    _items[head & (N - 1)] = item;
+    __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Consumer side. Returns false if the ring is empty.
+  bool pop(T *item) {
+    uint32_t tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&_head, __ATOMIC_ACQUIRE) == tail) {
+      return false;
+    }
+    *item = _items[tail & (N - 1)];
+    __atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Only a snapshot while the other side is running
+  uint32_t size() const {
+    return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+  }
+
+private:
+  T _items[N];
+  uint32_t _head;
+  uint32_t _tail;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "tls.h"
+#include "config.h"
+
+TLSStats tlsStats;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t checksum;
+  // BearSSL::Session only wraps br_ssl_session_parameters, which has no accessor
+  uint8_t session[(sizeof(BearSSL::Session) + 3) & ~3];
+} SessionRecord;
+
+static_assert(TLS_SESSION_RTC_OFFSET * 4 + sizeof(SessionRecord) <= 512, "TLS session doesn't fit in RTC user memory");
+
+static BearSSL::Session session;
+static SessionRecord record;
+static uint8_t sessionBefore[sizeof(BearSSL::Session)];
+static unsigned long connectStart;
+static uint32_t heapBefore;
+static volatile uint32_t heapLow;
+
+static uint32_t recordChecksum(const SessionRecord *r) {
+  const uint32_t *words = (const uint32_t *)r->session;
+  uint32_t sum = 0;
+  for (size_t i = 0; i < sizeof(r->session) / 4; i++) {
+    sum = (sum << 5 | sum >> 27) ^ words[i];
+  }
+  return sum;
+}
+
+// A session that never completed a handshake is all zeros
+static bool sessionValid(const uint8_t *bytes) {
+  for (size_t i = 0; i < sizeof(BearSSL::Session); i++) {
+    if (bytes[i] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void tlsBegin(BearSSL::WiFiClientSecure &client, const char *fingerprint) {
+  ESP.rtcUserMemoryRead(TLS_SESSION_RTC_OFFSET, (uint32_t *)&record, sizeof(record));
+  if (record.magic == TLS_SESSION_MAGIC && record.checksum == recordChecksum(&record)) {
+    memcpy((void *)&session, record.session, sizeof(session));
+  }
+  client.setFingerprint(fingerprint);
+  client.setBufferSizes(TLS_RX_BUFFER_SIZE, TLS_TX_BUFFER_SIZE);
+  client.setSession(&session);
+}
+
+void tlsConnectStart() {
+  memcpy(sessionBefore, (const void *)&session, sizeof(session));
+  heapBefore = heapLow = ESP.getFreeHeap();
+  connectStart = millis();
+}
+
+void tlsSampleHeap() {
+  uint32_t heap = ESP.getFreeHeap();
+  if (heap < heapLow) {
+    heapLow = heap;
+  }
+}
+
+void tlsConnectDone(bool connected) {
+  if (!connected) {
+    return;
+  }
+  tlsSampleHeap();
+  tlsStats.lastMs = millis() - connectStart;
+  tlsStats.heapHeld = heapBefore - ESP.getFreeHeap();
+  tlsStats.heapPeak = heapBefore - heapLow;
+  // The client stores the parameters of the new session in place, they only stay the same if it was resumed
+  tlsStats.lastResumed = sessionValid(sessionBefore) && memcmp(sessionBefore, (const void *)&session, sizeof(session)) == 0;
+  tlsStats.handshakes++;
+  if (tlsStats.lastResumed) {
+    tlsStats.resumptions++;
+  } else {
+    memcpy(record.session, (const void *)&session, sizeof(session));
+    record.magic = TLS_SESSION_MAGIC;
+    record.checksum = recordChecksum(&record);
+    ESP.rtcUserMemoryWrite(TLS_SESSION_RTC_OFFSET, (uint32_t *)&record, sizeof(record));
+  }
+}
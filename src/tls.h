@@ -0,0 +1,44 @@
+// MQTT over TLS with session resumption
+//
+// A full handshake costs the ESP8266 seconds of CPU for the key exchange.
+// The BearSSL session (ID and master secret) of the last connection is kept
+// and offered on the next connect, so a reconnect to the same broker only
+// needs the abbreviated handshake without any public key operations. The
+// session is also copied to RTC memory after every full handshake, which
+// survives soft resets (OTA, crashes, watchdog), but not power loss.
+//
+// The broker is authenticated by its certificate's SHA1 fingerprint, which
+// needs no clock. The buffers are kept small with the max fragment length
+// extension, which the broker has to support (Mosquitto with OpenSSL 1.1.1+).
+#ifndef tls_h
+#define tls_h
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+
+// In 4 byte blocks, after the watchdog's StallRecord
+#define TLS_SESSION_RTC_OFFSET 80
+#define TLS_SESSION_MAGIC 0x544C5353 // "TLSS"
+
+typedef struct {
+  uint32_t handshakes;
+  uint32_t resumptions;
+  uint32_t lastMs;       // Duration of the last connect, TCP, TLS and MQTT CONNECT
+  bool lastResumed;
+  uint32_t heapHeld;     // Heap held by the open connection
+  uint32_t heapPeak;     // Most heap in use during the last handshake
+} TLSStats;
+
+extern TLSStats tlsStats;
+
+// Sets up client and restores the session saved before a soft reset
+void tlsBegin(BearSSL::WiFiClientSecure &client, const char *fingerprint);
+
+// Call right before and after connecting
+void tlsConnectStart();
+void tlsConnectDone(bool connected);
+
+// Tracks the heap minimum while the handshake runs. Safe to call from a ticker.
+void tlsSampleHeap();
+
+#endif
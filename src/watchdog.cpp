@@ -0,0 +1,128 @@
+#include <Ticker.h>
+#include "watchdog.h"
+extern "C" {
+#include <cont.h>
+#include "user_interface.h"
+// The loop's continuation, owned by the core
+extern cont_t* g_pcont;
+}
+
+const char *loopStageNames[LoopStageCount] = {
+  "idle", "wifi", "network", "mqttconnect", "wake", "info", "status", "sensors", "mqttloop", "ota"
+};
+
+static Ticker ticker;
+static StallRecord record;
+static uint32_t stallThreshold;
+static volatile uint8_t currentStage = LoopStageIdle;
+static volatile unsigned long stageStart = 0;
+// Set once the current stage has been recorded as a stall
+static volatile bool stageRecorded = false;
+
+static uint32_t recordChecksum(const StallRecord *r) {
+  const uint32_t *words = (const uint32_t *)r;
+  uint32_t sum = 0;
+  for (size_t i = 2; i < sizeof(StallRecord) / 4; i++) {
+    sum = (sum << 5 | sum >> 27) ^ words[i];
+  }
+  return sum;
+}
+
+static void saveRecord() {
+  record.magic = STALL_RECORD_MAGIC;
+  record.checksum = recordChecksum(&record);
+  ESP.rtcUserMemoryWrite(STALL_RECORD_RTC_OFFSET, (uint32_t *)&record, sizeof(record));
+}
+
+// A record from before the last reset that hasn't been published yet. Stalls
+// while connecting at boot would otherwise overwrite the crash post-mortem.
+static bool holdingPreviousRecord() {
+  return record.resetReason != STALL_NO_RESET && !record.published;
+}
+
+static void recordStall(const uint32_t *stack, bool crashed) {
+  if (holdingPreviousRecord()) {
+    stageRecorded = true;
+    return;
+  }
+  record.uptime = stageStart;
+  record.duration = millis() - stageStart;
+  record.resetReason = STALL_NO_RESET;
+  record.stage = currentStage;
+  record.crashed = crashed;
+  record.published = false;
+  for (int i = 0; i < STALL_STACK_WORDS; i++) {
+    record.stack[i] = stack ? stack[i] : 0;
+  }
+  saveRecord();
+  stageRecorded = true;
+}
+
+// Runs in the system context, so it only fires while the loop yields (e.g. in delay())
+static void tick() {
+  if (stageRecorded || currentStage == LoopStageIdle || currentStage == LoopStageOTA) {
+    return;
+  }
+  if (millis() - stageStart > stallThreshold) {
+    // The loop is suspended in yield(), its stack pointer shows where
+    recordStall((const uint32_t *)g_pcont->sp_yield, false);
+  }
+}
+
+// Called by the core on exceptions and soft WDT resets
+extern "C" void custom_crash_callback(struct rst_info *rst_info, uint32_t stack, uint32_t stack_end) {
+  (void)rst_info;
+  if (currentStage == LoopStageIdle || stack_end - stack < STALL_STACK_WORDS * 4) {
+    recordStall(NULL, true);
+  } else {
+    recordStall((const uint32_t *)stack, true);
+  }
+}
+
+void watchdogBegin(uint32_t threshold) {
+  stallThreshold = threshold;
+  ESP.rtcUserMemoryRead(STALL_RECORD_RTC_OFFSET, (uint32_t *)&record, sizeof(record));
+  if (record.magic != STALL_RECORD_MAGIC || record.checksum != recordChecksum(&record)) {
+    memset(&record, 0, sizeof(record));
+    record.published = true;
+  } else if (!record.published && record.resetReason == STALL_NO_RESET) {
+    // The device reset before the stall was reported
+    record.resetReason = ESP.getResetInfoPtr()->reason;
+    saveRecord();
+  }
+  ticker.attach_ms(WATCHDOG_TICK_MS, tick);
+}
+
+void watchdogSetThreshold(uint32_t threshold) {
+  stallThreshold = threshold;
+}
+
+void loopStage(uint8_t stage) {
+  unsigned long now = millis();
+  if (!stageRecorded && currentStage != LoopStageIdle && currentStage != LoopStageOTA
+      && now - stageStart > stallThreshold) {
+    // Stalled without yielding, so the ticker didn't get to see it
+    recordStall(NULL, false);
+  } else if (stageRecorded && !record.published && !holdingPreviousRecord()) {
+    // Update the duration of a stall the ticker recorded while it was in progress
+    record.duration = now - stageStart;
+    saveRecord();
+  }
+  currentStage = stage;
+  stageStart = now;
+  stageRecorded = false;
+}
+
+bool watchdogPendingRecord(StallRecord *pending) {
+  // Don't report a stall that is still in progress
+  if (record.published || (stageRecorded && currentStage != LoopStageIdle)) {
+    return false;
+  }
+  *pending = record;
+  return true;
+}
+
+void watchdogMarkPublished() {
+  record.published = true;
+  saveRecord();
+}
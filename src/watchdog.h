@@ -0,0 +1,63 @@
+// Loop stall watchdog
+//
+// The loop marks which stage it is in with loopStage(). A ticker checks
+// every WATCHDOG_TICK_MS whether the current stage has been running for
+// longer than the stall threshold and, if so, writes a StallRecord with
+// the stage, its duration and a few words of the loop's stack to RTC
+// memory. Crashes and soft WDT resets are recorded from the core's crash
+// callback. The record survives resets and is reported on the next boot.
+#ifndef watchdog_h
+#define watchdog_h
+
+#include <Arduino.h>
+
+#define WATCHDOG_TICK_MS 250
+// In 4 byte blocks. The start of RTC user memory holds the eboot command used by OTA.
+#define STALL_RECORD_RTC_OFFSET 64
+#define STALL_RECORD_MAGIC 0x5354414C // "STAL"
+#define STALL_STACK_WORDS 8
+#define STALL_NO_RESET 0xFF
+
+typedef enum {
+  LoopStageIdle = 0,
+  LoopStageWiFi,
+  LoopStageNetwork,
+  LoopStageMQTTConnect,
+  LoopStageWake,
+  LoopStageInfo,
+  LoopStageStatus,
+  LoopStageSensors,
+  LoopStageMQTTLoop,
+  LoopStageOTA, // Exempt from stall detection
+  LoopStageCount
+} LoopStage;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t checksum;
+  uint32_t uptime;      // millis() when the stall started
+  uint32_t duration;    // ms spent in the stage
+  uint32_t resetReason; // rst_info reason of the following boot, STALL_NO_RESET if there was none
+  uint8_t stage;        // One of LoopStage
+  uint8_t crashed;      // Recorded by the crash handler right before a reset
+  uint8_t published;
+  uint8_t reserved;
+  uint32_t stack[STALL_STACK_WORDS];
+} StallRecord;
+
+extern const char *loopStageNames[LoopStageCount];
+
+// Loads the record of the previous boot and starts the ticker
+void watchdogBegin(uint32_t threshold);
+
+void watchdogSetThreshold(uint32_t threshold);
+
+// Marks the start of the next loop stage, which also ends the current one
+void loopStage(uint8_t stage);
+
+// Returns true and fills record if there is a stall record that hasn't been published yet
+bool watchdogPendingRecord(StallRecord *record);
+
+void watchdogMarkPublished();
+
+#endif
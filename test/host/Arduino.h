@@ -0,0 +1,43 @@
+// Just enough of the Arduino core to build src modules on the host
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// Defined by the test
+unsigned long millis();
+void yield();
+
+inline void delay(unsigned long) {}
+
+// The core's are macros, which would break the standard headers
+template <typename A, typename B>
+inline auto min(A a, B b) -> decltype(a < b ? a : b) { return a < b ? a : b; }
+template <typename A, typename B>
+inline auto max(A a, B b) -> decltype(a > b ? a : b) { return a > b ? a : b; }
+
+// Stand-in for the UART the Roomba library talks to, tests derive from it
+class HardwareSerial {
+public:
+  virtual ~HardwareSerial() {}
+  virtual void begin(unsigned long) {}
+  virtual size_t write(uint8_t) { return 1; }
+  size_t write(const uint8_t *buf, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      write(buf[i]);
+    }
+    return size;
+  }
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual void flush() {}
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,16 @@
+// The constants of PubSubClient that the MQTT 5 client shares
+#ifndef PubSubClient_h
+#define PubSubClient_h
+
+// As set in platformio.ini
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE 1024
+#endif
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+
+#endif
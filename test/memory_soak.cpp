@@ -0,0 +1,158 @@
+// Host soak test of the heap behaviour of the host buildable modules
+//
+// Runs the MQTT 5 client (src/mqtt5.cpp) and the binary log (src/binlog.cpp)
+// for many rounds of the firmware's steady state: an INFO sized publish,
+// status publishes, an inbound QoS 1 command and verbose log records. Free
+// heap is tracked the way INFO reports it, as the worst value since start,
+// and has to stop moving once the first rounds are done. Every publish has to
+// fit MQTT_MAX_PACKET_SIZE. Build and run with
+//
+//   g++ -O2 -I test/host -I src test/memory_soak.cpp src/mqtt5.cpp src/binlog.cpp -o /tmp/memory_soak && /tmp/memory_soak [rounds]
+#include <deque>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "binlog.h"
+#include "mqtt5.h"
+
+#define SOAK_ROUNDS 100000
+#define SOAK_WARMUP_ROUNDS 1000
+// Largest INFO payload with all optional fields, see the loop() in main.cpp
+#define SOAK_INFO_BYTES 700
+#define SOAK_STATUS_BYTES 250
+
+static unsigned long now;
+
+unsigned long millis() {
+  return now;
+}
+
+void yield() {
+}
+
+// Answers CONNECT and PINGREQ like a broker and swallows everything else
+class LoopbackClient : public Client {
+public:
+  int connect(const char *, uint16_t) {
+    _connected = true;
+    return 1;
+  }
+
+  size_t write(const uint8_t *buf, size_t size) {
+    if (size > 0 && buf[0] == 0x10) {
+      static const uint8_t connack[] = {0x20, 3, 0, 0, 0};
+      inbound.insert(inbound.end(), connack, connack + sizeof(connack));
+    } else if (size > 0 && buf[0] == 0xC0) {
+      inbound.push_back(0xD0);
+      inbound.push_back(0);
+    }
+    return size;
+  }
+
+  int available() {
+    return inbound.size();
+  }
+
+  int read() {
+    int b = inbound.front();
+    inbound.pop_front();
+    return b;
+  }
+
+  uint8_t connected() {
+    return _connected;
+  }
+
+  void stop() {
+    _connected = false;
+  }
+
+  std::deque<uint8_t> inbound;
+
+private:
+  bool _connected = false;
+};
+
+static LoopbackClient loopback;
+static MQTT5Client client(loopback);
+static uint32_t commandsReceived;
+
+static void callback(char *, uint8_t *, unsigned int) {
+  commandsReceived++;
+}
+
+static void queueCommand(uint16_t packetId) {
+  char payload[64];
+  int length = snprintf(payload, sizeof(payload), "{\"id\":\"%u\",\"command\":\"clean\"}", packetId);
+  static const char topic[] = "vacuum/command";
+  uint32_t remaining = 2 + sizeof(topic) - 1 + 2 + 1 + length;
+  loopback.inbound.push_back(0x32);
+  loopback.inbound.push_back(remaining);
+  loopback.inbound.push_back(0);
+  loopback.inbound.push_back(sizeof(topic) - 1);
+  loopback.inbound.insert(loopback.inbound.end(), topic, topic + sizeof(topic) - 1);
+  loopback.inbound.push_back(packetId >> 8);
+  loopback.inbound.push_back(packetId & 0xFF);
+  loopback.inbound.push_back(0); // No properties
+  loopback.inbound.insert(loopback.inbound.end(), payload, payload + length);
+}
+
+static size_t heapInUse() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks;
+}
+
+int main(int argc, char **argv) {
+  uint32_t rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : SOAK_ROUNDS;
+  client.setServer("broker", 1883);
+  client.setCallback(callback);
+  client.setUserProperty("schema", "1");
+  client.addTopicAlias("vacuum/status");
+  if (!client.connect("roomba", "vacuum/status", 0, true, "{\"state\":\"offline\"}", false, 3600)) {
+    printf("FAIL connect\n");
+    return EXIT_FAILURE;
+  }
+
+  static uint8_t info[SOAK_INFO_BYTES];
+  static uint8_t status[SOAK_STATUS_BYTES];
+  memset(info, 'i', sizeof(info));
+  memset(status, 's', sizeof(status));
+  uint8_t chunk[BINLOG_MAX_RECORD];
+  uint32_t failedPublishes = 0;
+  size_t heapWorst = 0, heapAfterWarmup = 0;
+
+  for (uint32_t round = 0; round < rounds; round++) {
+    now += 1000;
+    if (!client.publish("vacuum/INFO", info, sizeof(info), false, 900)) {
+      failedPublishes++;
+    }
+    if (!client.publish("vacuum/status", status, sizeof(status), true, 900)) {
+      failedPublishes++;
+    }
+    queueCommand(round % 0xFFFF + 1);
+    while (loopback.available()) {
+      client.loop();
+    }
+    BLOG("Got Packet of len=%d! OIMode:%d Distance:%dmm\n", 80, 3, (int)round);
+    BLOG_BYTES("Packet", status, 150);
+    if (round % 10 == 0) {
+      while (binlogRead(chunk, sizeof(chunk)) > 0) {
+      }
+    }
+
+    size_t heap = heapInUse();
+    if (heap > heapWorst) {
+      heapWorst = heap;
+    }
+    if (round + 1 == SOAK_WARMUP_ROUNDS) {
+      heapAfterWarmup = heapWorst;
+    }
+  }
+
+  bool heapStable = rounds <= SOAK_WARMUP_ROUNDS || heapWorst == heapAfterWarmup;
+  bool ok = failedPublishes == 0 && commandsReceived == rounds && heapStable;
+  printf("rounds=%u failedPublishes=%u commands=%u heapAfterWarmup=%zu heapWorst=%zu\n",
+         rounds, failedPublishes, commandsReceived, heapAfterWarmup, heapWorst);
+  printf("%s\n", ok ? "PASSED" : "FAILED");
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
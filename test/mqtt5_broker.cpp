@@ -0,0 +1,249 @@
+// Host test of the MQTT 5 client (src/mqtt5.cpp) against a real broker
+//
+// Runs MQTT5Client over a POSIX socket against a broker without
+// authentication, e.g. a local Mosquitto 2 started with `mosquitto -v`:
+//  - topic aliases: two publishes on an aliased topic come back with the topic
+//  - QoS 1: a message bigger than the client's buffer is dropped, the next
+//    one is delivered
+//  - both were acknowledged: nothing is redelivered when the session resumes,
+//    counted in bytes since the oversized one would be dropped again
+// Build and run with
+//
+//   g++ -I test/host -I src test/mqtt5_broker.cpp src/mqtt5.cpp -o /tmp/mqtt5_broker && /tmp/mqtt5_broker [host [port]]
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "mqtt5.h"
+
+#define TEST_CLIENT_ID "roomba-mqtt5-test"
+#define TEST_TOPIC_ALIAS "mqtt5test/alias"
+#define TEST_TOPIC_BIG "mqtt5test/big"
+#define TEST_TOPIC_SMALL "mqtt5test/small"
+#define TEST_SESSION_EXPIRY_S 60
+#define TEST_WAIT_MS 2000
+
+unsigned long millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+void yield() {
+  usleep(1000);
+}
+
+static int connectSocket(const char *host, uint16_t port) {
+  struct addrinfo hints = {}, *result;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &result) != 0) {
+    return -1;
+  }
+  int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+  return fd;
+}
+
+class SocketClient : public Client {
+public:
+  SocketClient() : bytesRead(0), _fd(-1) {}
+
+  // Also counts what the client drops
+  size_t bytesRead;
+
+  int connect(const char *host, uint16_t port) {
+    stop();
+    _fd = connectSocket(host, port);
+    return _fd >= 0;
+  }
+
+  size_t write(const uint8_t *buf, size_t size) {
+    ssize_t n = _fd >= 0 ? send(_fd, buf, size, MSG_NOSIGNAL) : -1;
+    return n < 0 ? 0 : n;
+  }
+
+  int available() {
+    int n = 0;
+    if (_fd < 0 || ioctl(_fd, FIONREAD, &n) != 0) {
+      return 0;
+    }
+    if (n == 0) {
+      // A closed connection reads as end of file
+      uint8_t b;
+      if (recv(_fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        stop();
+      }
+    }
+    return n;
+  }
+
+  int read() {
+    uint8_t b;
+    if (_fd < 0 || recv(_fd, &b, 1, 0) != 1) {
+      return -1;
+    }
+    bytesRead++;
+    return b;
+  }
+
+  uint8_t connected() {
+    available();
+    return _fd >= 0;
+  }
+
+  void stop() {
+    if (_fd >= 0) {
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+private:
+  int _fd;
+};
+
+// Publishes at QoS 1 from a second, raw MQTT 3.1.1 connection, since the
+// client under test only publishes at QoS 0. Returns false without a PUBACK.
+static bool publishQos1(const char *host, uint16_t port, const char *topic, const std::string &payload) {
+  int fd = connectSocket(host, port);
+  if (fd < 0) {
+    return false;
+  }
+  static const uint8_t connectPacket[] = {
+    0x10, 20, 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 30,
+    0, 8, 'q', 'o', 's', '1', '-', 'p', 'u', 'b'
+  };
+  std::string packet((const char *)connectPacket, sizeof(connectPacket));
+
+  size_t topicLength = strlen(topic);
+  uint32_t remaining = 2 + topicLength + 2 + payload.size();
+  packet += (char)0x32;
+  do {
+    uint8_t b = remaining & 0x7F;
+    remaining >>= 7;
+    packet += (char)(remaining ? b | 0x80 : b);
+  } while (remaining);
+  packet += (char)(topicLength >> 8);
+  packet += (char)(topicLength & 0xFF);
+  packet += topic;
+  packet += (char)0;
+  packet += (char)1; // Packet ID
+  packet += payload;
+  bool sent = send(fd, packet.data(), packet.size(), MSG_NOSIGNAL) == (ssize_t)packet.size();
+
+  // CONNACK then PUBACK, 4 bytes each
+  uint8_t reply[8];
+  size_t got = 0;
+  while (sent && got < sizeof(reply)) {
+    ssize_t n = recv(fd, reply + got, sizeof(reply) - got, 0);
+    if (n <= 0) {
+      break;
+    }
+    got += n;
+  }
+  close(fd);
+  return got == sizeof(reply) && reply[3] == 0 && reply[4] == 0x40;
+}
+
+static SocketClient socketClient;
+static MQTT5Client client(socketClient);
+
+static std::string lastTopic;
+static std::string lastPayload;
+static uint16_t lastPacketId;
+static int received;
+
+static void callback(char *topic, uint8_t *payload, unsigned int length) {
+  lastTopic = topic;
+  lastPayload = std::string((const char *)payload, length);
+  lastPacketId = client.inboundPacketId();
+  received++;
+}
+
+static void pump(unsigned long ms) {
+  unsigned long start = millis();
+  while (millis() - start < ms) {
+    client.loop();
+    yield();
+  }
+}
+
+static bool waitFor(int count) {
+  unsigned long start = millis();
+  while (received < count && millis() - start < TEST_WAIT_MS) {
+    client.loop();
+    yield();
+  }
+  return received >= count;
+}
+
+static int failures;
+
+static void check(bool ok, const char *what) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) {
+    failures++;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *host = argc > 1 ? argv[1] : "localhost";
+  uint16_t port = argc > 2 ? atoi(argv[2]) : 1883;
+
+  client.setServer(host, port);
+  client.setCallback(callback);
+  client.setUserProperty("schema", "1");
+  client.addTopicAlias(TEST_TOPIC_ALIAS);
+
+  bool connected = client.connect(TEST_CLIENT_ID, NULL, 0, false, NULL, true, TEST_SESSION_EXPIRY_S);
+  check(connected, "connect with a clean start and a session expiry");
+  if (!connected) {
+    printf("state %d\n", client.state());
+    return EXIT_FAILURE;
+  }
+  check(client.subscribe("mqtt5test/#", 1), "subscribe at QoS 1");
+  pump(200);
+
+  // The first publish registers the alias, the second only sends the alias
+  client.publish(TEST_TOPIC_ALIAS, (const uint8_t *)"first", 5, false, 60);
+  client.publish(TEST_TOPIC_ALIAS, (const uint8_t *)"second", 6, false, 60);
+  check(waitFor(2) && lastTopic == TEST_TOPIC_ALIAS && lastPayload == "second", "aliased publishes arrive with their topic");
+
+  std::string big(MQTT_MAX_PACKET_SIZE + 100, 'x');
+  check(publishQos1(host, port, TEST_TOPIC_BIG, big), "publish an oversized message at QoS 1");
+  check(publishQos1(host, port, TEST_TOPIC_SMALL, "small"), "publish a small message at QoS 1");
+  int before = received;
+  check(waitFor(before + 1) && lastTopic == TEST_TOPIC_SMALL && lastPayload == "small", "oversized message dropped, next one delivered");
+  check(lastPacketId != 0, "QoS 1 message has a packet ID");
+  pump(200);
+  check(received == before + 1, "oversized message not passed on");
+
+  // Anything left unacknowledged is delivered again when the session resumes
+  client.disconnect();
+  connected = client.connect(TEST_CLIENT_ID, NULL, 0, false, NULL, false, TEST_SESSION_EXPIRY_S);
+  check(connected, "resume the session");
+  before = received;
+  size_t bytesBefore = socketClient.bytesRead;
+  pump(TEST_WAIT_MS);
+  check(received == before && socketClient.bytesRead - bytesBefore < MQTT_MAX_PACKET_SIZE, "nothing redelivered after resuming the session");
+
+  // Leave no session behind
+  client.disconnect();
+  client.connect(TEST_CLIENT_ID, NULL, 0, false, NULL, true, 0);
+  client.disconnect();
+
+  printf("%s\n", failures ? "FAILED" : "PASSED");
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+// Host replay of a serial capture through the firmware's stream decoding
+//
+// Reads capture records (uint16 ms since the previous record, uint8 length,
+// bytes, little endian, see capture.h) from stdin, as written by
+// tools/capture_replay.py --host. The bytes go through a fake UART into
+// Roomba::pollSensors() and parseRoombaStateFromStreamPacket(), polled every
+// 5 ms of capture time like the firmware's ingest ticker. Every frame is
+// printed with the state it decoded to. Time comes from the capture, not the
+// wall clock, so the output only depends on the capture and can be diffed
+// against that of a known good build. Build with
+//
+//   g++ -DARDUINO=10800 -I test/host -I src -I lib/Roomba test/stream_replay.cpp src/sensors.cpp src/binlog.cpp lib/Roomba/Roomba.cpp -o /tmp/stream_replay
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include "sensors.h"
+
+// Same as SENSOR_INGEST_INTERVAL_MS in config.h
+#define REPLAY_INGEST_INTERVAL_MS 5
+
+static unsigned long now;
+
+unsigned long millis() {
+  return now;
+}
+
+void yield() {
+}
+
+class ReplaySerial : public HardwareSerial {
+public:
+  size_t write(uint8_t) {
+    return 1;
+  }
+
+  int available() {
+    return received.size();
+  }
+
+  int read() {
+    int b = received.front();
+    received.pop_front();
+    return b;
+  }
+
+  std::deque<uint8_t> received;
+};
+
+static ReplaySerial replaySerial;
+static Roomba roomba(&replaySerial, Roomba::Baud115200);
+static uint8_t packet[150];
+static uint32_t frames, failures;
+
+static void printFrame(uint8_t length, bool checksumOk) {
+  RoombaState state = {};
+  bool parsed = checksumOk && parseRoombaStateFromStreamPacket(packet, length, &state);
+  frames++;
+  if (!parsed) {
+    failures++;
+    printf("%8lu ms len=%u %s\n", now, length, checksumOk ? "unparsed" : "checksum");
+    return;
+  }
+  printf("%8lu ms len=%u OIMode=%u Distance=%d ChargingState=%u Voltage=%u Current=%d Charge=%d Capacity=%u Temp=%d"
+         " Sources=%u Bumps=%u Cliffs=%u Wall=%u Overcurrents=%u Encoders=%d,%d MotorCurrents=%d,%d Stasis=%u\n",
+         now, length, state.OIMode, state.distance, state.chargingState, state.voltage, state.current, state.charge,
+         state.capacity, state.temp, state.chargingSourcesAvailable, state.bumpsAndWheelDrops, state.cliffs,
+         state.virtualWall, state.overcurrents, state.leftencodercounts, state.rightencodercounts,
+         state.leftMotorCurrent, state.rightMotorCurrent, state.stasis);
+}
+
+// One poll per tick, like ingestSensors(). The length is only set once a
+// frame is complete, whether its checksum matched or not.
+static void ingest() {
+  uint8_t length = 0;
+  bool ok = roomba.pollSensors(packet, sizeof(packet), &length);
+  if (length != 0) {
+    printFrame(length, ok);
+  }
+}
+
+int main() {
+  unsigned long nextIngest = REPLAY_INGEST_INTERVAL_MS;
+  uint8_t header[3];
+  uint8_t data[256];
+  while (fread(header, 1, sizeof(header), stdin) == sizeof(header)) {
+    unsigned long at = now + (header[0] | header[1] << 8);
+    if (fread(data, 1, header[2], stdin) != header[2]) {
+      break;
+    }
+    // The ticker polls in between
+    while ((long)(at - nextIngest) >= 0) {
+      now = nextIngest;
+      ingest();
+      nextIngest += REPLAY_INGEST_INTERVAL_MS;
+    }
+    now = at;
+    replaySerial.received.insert(replaySerial.received.end(), data, data + header[2]);
+  }
+  // Drain what came in with the last records
+  while (replaySerial.available()) {
+    now = nextIngest;
+    ingest();
+    nextIngest += REPLAY_INGEST_INTERVAL_MS;
+  }
+  fprintf(stderr, "%u frames, %u failed\n", frames, failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
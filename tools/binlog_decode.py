@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""Formats binary logs recorded by the firmware's VLOG/BLOG macros.
+
+The ID -> format string table is generated from the firmware sources, so run
+this against the same revision that is running on the device.
+
+Usage:
+  # Telnet capture containing the output of the `binlog` command
+  binlog_decode.py telnet.log
+  # Raw payloads received on the debug topic after a `dump_log` command
+  mosquitto_sub -t vacuum/DEBUG -C 1 > dump.bin && binlog_decode.py --raw dump.bin
+"""
+import argparse
+import glob
+import os
+import re
+import struct
+import sys
+
+LOG_SITE = re.compile(r'\b(?:VLOG|BLOG|BLOG_BYTES)\s*\(\s*"((?:[^"\\]|\\.)*)"')
+ESCAPES = {'n': '\n', 't': '\t', 'r': '\r', '\\': '\\', '"': '"', "'": "'", '0': '\0'}
+HEADER = struct.Struct('<HBBI')
+
+
+def unescape(literal):
+    return re.sub(r'\\(.)', lambda m: ESCAPES.get(m.group(1), m.group(1)), literal)
+
+
+def binlog_hash(fmt):
+    # Must match binlogHash() in src/binlog.h
+    h = 2166136261
+    for b in fmt.encode('latin-1'):
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return (h ^ (h >> 16)) & 0xffff
+
+
+def build_table(source_dir):
+    table = {}
+    for path in glob.glob(os.path.join(source_dir, '*.cpp')) + glob.glob(os.path.join(source_dir, '*.h')):
+        with open(path) as f:
+            for match in LOG_SITE.finditer(f.read()):
+                fmt = unescape(match.group(1))
+                table.setdefault(binlog_hash(fmt), fmt)
+    return table
+
+
+def read_telnet(path):
+    data = bytearray()
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('BL-DROPPED'):
+                sys.stderr.write('%s records dropped on the device\n' % line.split()[1])
+            elif line.startswith('BL '):
+                data += bytes.fromhex(line[3:])
+    return bytes(data)
+
+
+def decode(data, table):
+    offset = 0
+    while offset + HEADER.size <= len(data):
+        log_id, argc, blob_length, millis = HEADER.unpack_from(data, offset)
+        offset += HEADER.size
+        args = struct.unpack_from('<%di' % argc, data, offset)
+        offset += argc * 4
+        blob = data[offset:offset + blob_length]
+        offset += blob_length
+        fmt = table.get(log_id)
+        if fmt is None:
+            text = 'unknown log id 0x%04x %r %s\n' % (log_id, args, blob.hex())
+        elif blob_length:
+            text = fmt.replace('%s', ' '.join(str(b) for b in blob), 1)
+        else:
+            try:
+                text = fmt % args
+            except (TypeError, ValueError):
+                text = '%s %r\n' % (fmt.rstrip('\n'), args)
+        sys.stdout.write('[%10.3f] %s' % (millis / 1000.0, text))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('input', help='telnet capture or raw dump')
+    parser.add_argument('--raw', action='store_true', help='input is a raw binary dump from MQTT')
+    parser.add_argument('--src', default=os.path.join(os.path.dirname(__file__), '..', 'src'),
+                        help='firmware source directory')
+    args = parser.parse_args()
+
+    table = build_table(args.src)
+    if args.raw:
+        with open(args.input, 'rb') as f:
+            data = f.read()
+    else:
+        data = read_telnet(args.input)
+    decode(data, table)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Reassembles serial captures uploaded by the firmware and replays them.
+
+Start a capture with the `capture_start [seconds]` command and record the
+chunks published on vacuum/CAPTURE:
+
+  mosquitto_sub -t vacuum/CAPTURE -F '%l %p' > capture.stream
+
+Then run the same bytes through the firmware's stream decoding in the host
+build (test/stream_replay.cpp), which prints every frame and what it decoded
+to. The output only depends on the capture, so it can be kept and diffed as a
+regression test:
+
+  capture_replay.py capture.stream --host /tmp/stream_replay
+  capture_replay.py capture.stream --host /tmp/stream_replay --max-speed > expected.txt
+
+Or, with a USB serial adapter wired to the ESP's RX pin in place of the
+Roomba, feed the same bytes with the same timing to the device:
+
+  capture_replay.py capture.stream --port /dev/ttyUSB0
+  capture_replay.py capture.stream --port /dev/ttyUSB0 --max-speed
+
+Or look at the stream packets the capture contains, with their checksums:
+
+  capture_replay.py capture.stream --frames
+"""
+import argparse
+import struct
+import subprocess
+import sys
+import time
+
+CHUNK_HEADER = struct.Struct('<BBHI')
+RECORD_HEADER = struct.Struct('<HB')
+VERSION = 1
+FLAG_START = 0x1
+FLAG_END = 0x2
+
+
+def read_stream(f):
+    # mosquitto_sub -F '%l %p': payload length, a space, the payload, a newline
+    while True:
+        length = b''
+        while not length.endswith(b' '):
+            c = f.read(1)
+            if not c:
+                return
+            length += c
+        yield f.read(int(length))
+        f.read(1)
+
+
+def parse_records(chunks):
+    """Yields (ms since the previous record, bytes) for the last capture in chunks."""
+    records = []
+    expected = None
+    reported = 0
+    for chunk in chunks:
+        version, flags, sequence, dropped = CHUNK_HEADER.unpack_from(chunk)
+        if version != VERSION:
+            raise ValueError('unsupported capture version %d' % version)
+        if flags & FLAG_START:
+            records = []
+            reported = 0
+        elif expected is not None and sequence != expected:
+            print('warning: missing chunks %d to %d' % (expected, sequence - 1), file=sys.stderr)
+        expected = (sequence + 1) & 0xffff
+        if dropped > reported:
+            # The timing right after the gap is off by the length of the dropped records
+            print('warning: %d bytes dropped on the device before chunk %d' % (dropped - reported, sequence), file=sys.stderr)
+            reported = dropped
+        pos = CHUNK_HEADER.size
+        while pos < len(chunk):
+            delta, length = RECORD_HEADER.unpack_from(chunk, pos)
+            pos += RECORD_HEADER.size
+            records.append((delta, chunk[pos:pos + length]))
+            pos += length
+        if flags & FLAG_END:
+            break
+    return records
+
+
+def paced(records, speed):
+    """Yields the records at their capture times scaled by speed, 0 for no waiting."""
+    start = time.monotonic()
+    at = 0.0
+    for delta, data in records:
+        at += delta / 1000.0
+        if speed:
+            wait = start + at / speed - time.monotonic()
+            if wait > 0:
+                time.sleep(wait)
+        yield delta, data
+
+
+def replay(records, port, baud, speed):
+    import serial  # pyserial
+    with serial.Serial(port, baud) as out:
+        for _, data in paced(records, speed):
+            out.write(data)
+        out.flush()
+
+
+def replay_host(records, binary, speed):
+    # The host build reads the records as captured and keeps time by their deltas
+    host = subprocess.Popen([binary], stdin=subprocess.PIPE)
+    for delta, data in paced(records, speed):
+        host.stdin.write(RECORD_HEADER.pack(delta, len(data)) + data)
+        host.stdin.flush()
+    host.stdin.close()
+    return host.wait()
+
+
+def print_frames(records):
+    # Same state machine as Roomba::pollSensors()
+    t = 0
+    frame = None
+    for delta, data in records:
+        t += delta
+        for b in data:
+            if frame is None:
+                if b == 19:
+                    frame = bytearray([b])
+                continue
+            frame.append(b)
+            if len(frame) > 2 and len(frame) == frame[1] + 3:
+                ok = sum(frame) & 0xff == 0
+                print('%8d ms %s %s' % (t, 'ok ' if ok else 'BAD', ' '.join(str(x) for x in frame[2:-1])))
+                frame = None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('capture', help="chunks recorded with mosquitto_sub -F '%%l %%p', - for stdin")
+    parser.add_argument('--port', help='serial port to replay to')
+    parser.add_argument('--host', metavar='BINARY', help='host build of the stream decoding to replay to (test/stream_replay.cpp)')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--speed', type=float, default=1.0, help='replay speed factor, 1 is real time')
+    parser.add_argument('--max-speed', action='store_true', help='replay without waiting between records')
+    parser.add_argument('--frames', action='store_true', help='print the stream packets in the capture')
+    args = parser.parse_args()
+
+    f = sys.stdin.buffer if args.capture == '-' else open(args.capture, 'rb')
+    records = parse_records(read_stream(f))
+    total = sum(len(data) for _, data in records)
+    duration = sum(delta for delta, _ in records)
+    print('%d bytes in %d records over %.1fs' % (total, len(records), duration / 1000.0), file=sys.stderr)
+    if args.frames:
+        print_frames(records)
+    speed = 0 if args.max_speed else args.speed
+    if args.host:
+        sys.exit(replay_host(records, args.host, speed))
+    if args.port:
+        replay(records, args.port, args.baud, speed)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Renders the coverage map published by the firmware on vacuum/COVERAGE.
+
+Each message carries the tiles that changed since the previous one (see
+src/coverage.h), so feed it every message of a run, in order. Messages are
+read one per file, or as length prefixed records with --stream.
+
+Usage:
+  # One file per message
+  coverage_decode.py msg1.bin msg2.bin ...
+  # Or straight from the broker, until interrupted
+  mosquitto_sub -t vacuum/COVERAGE -F '%l %p' | coverage_decode.py --stream
+"""
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct('<BBBBHhhH')
+VERSION = 1
+FLAG_RESET = 0x1
+
+
+class Map:
+    def __init__(self):
+        self.grid = 0
+        self.visited = set()
+        self.obstacles = set()
+        self.pose = (0, 0, 0)
+        self.cell_mm = 0
+
+    def apply(self, data):
+        version, flags, grid, tile, cell_mm, x, y, heading = HEADER.unpack_from(data)
+        if version != VERSION:
+            raise ValueError('unsupported coverage version %d' % version)
+        if flags & FLAG_RESET or grid != self.grid:
+            self.visited.clear()
+            self.obstacles.clear()
+        self.grid, self.cell_mm = grid, cell_mm
+        self.pose = (x, y, heading * 360.0 / 65536)
+        tiles = grid // tile
+        pos = HEADER.size
+        while pos + 2 <= len(data):
+            index, planes = data[pos], data[pos + 1]
+            pos += 2
+            tx, ty = index % tiles * tile, index // tiles * tile
+            for plane, cells in enumerate((self.visited, self.obstacles)):
+                if not planes & (1 << plane):
+                    continue
+                for row in range(tile):
+                    bits = data[pos + row]
+                    for col in range(tile):
+                        cell = (tx + col, ty + row)
+                        if bits & (1 << col):
+                            cells.add(cell)
+                        else:
+                            cells.discard(cell)
+                pos += tile
+
+    def render(self):
+        lines = []
+        # North up, so the rows are printed from the top of the grid
+        for y in reversed(range(self.grid)):
+            line = ''
+            for x in range(self.grid):
+                line += '#' if (x, y) in self.obstacles else '.' if (x, y) in self.visited else ' '
+            lines.append(line.rstrip())
+        while lines and not lines[0]:
+            lines.pop(0)
+        while lines and not lines[-1]:
+            lines.pop()
+        area = len(self.visited) * self.cell_mm * self.cell_mm / 1e6
+        lines.append('%d cells covered (%.1f m2), robot at %d,%d mm heading %.0f' %
+                     ((len(self.visited), area) + self.pose))
+        return '\n'.join(lines)
+
+
+def read_stream(f):
+    # mosquitto_sub -F '%l %p': payload length, a space, the payload
+    while True:
+        length = b''
+        while not length.endswith(b' '):
+            c = f.read(1)
+            if not c:
+                return
+            length += c
+        yield f.read(int(length))
+        f.read(1)  # Newline
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('files', nargs='*', help='message payloads, one per file')
+    parser.add_argument('--stream', action='store_true', help='read length prefixed payloads from stdin')
+    args = parser.parse_args()
+
+    coverage = Map()
+    if args.stream:
+        for payload in read_stream(sys.stdin.buffer):
+            coverage.apply(payload)
+            print(coverage.render() + '\n')
+    else:
+        for path in args.files:
+            with open(path, 'rb') as f:
+                coverage.apply(f.read())
+        print(coverage.render())
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,20 @@
+# PlatformIO extra script: builds a gzip compressed copy of the firmware and
+# uploads that one over OTA. The ESP8266 Arduino core (2.7.0 and newer)
+# decompresses it while flashing and verifies the MD5 sent by espota before
+# the new image is activated.
+Import("env")
+
+import gzip
+import shutil
+
+
+def gzip_firmware(source, target, env):
+    firmware = str(target[0])
+    with open(firmware, "rb") as f_in, gzip.open(firmware + ".gz", "wb", compresslevel=9) as f_out:
+        shutil.copyfileobj(f_in, f_out)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", gzip_firmware)
+
+if env.GetProjectOption("upload_protocol", "") == "espota":
+    env.Replace(UPLOADCMD='"$PYTHONEXE" "$UPLOADER" $UPLOADERFLAGS -f ${SOURCE}.gz')